@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../ethpipe_tx.h"
+
+/*
+ * ep_bench: the driver's TX datapath (ethpipe_tx.h) against a mock NIC
+ *
+ *   ep_bench [-t sec] [-l frame_len] [-n pkts_per_write] [-c contexts]
+ *            [-q txq_kb] [-w window_kb] [-r nic_mbps] [-v] [-o name=value ...]
+ *
+ * Producer threads call the write() loop of the driver, without the
+ * uaccess, on a buffer of pkts_per_write records, one TX context each.
+ * The main thread stands in for the TX kthread and runs ethpipe_sched()
+ * on queue 0.  A NIC thread plays the FPGA: the TX window (mmio1) and
+ * the TX0_WRITE_ADDR/TX0_READ_ADDR registers (mmio0) are plain memory,
+ * and it advances TX0_READ_ADDR up to the doorbell, at nic_mbps if
+ * given.  With -v it also checks every frame header in the window.
+ *
+ * -o sets the datapath module parameters, e.g. -o tx_db_pkts=16.
+ * The mock window is cacheable memory, so the non-temporal stores of
+ * tx_wc_simd measure slower here than against the write-combining BAR.
+ * Run it under perf record or VTune; the kthread work is in main().
+ * Cycles per packet come from per-thread perf counters and are 0 where
+ * those are not available (e.g. in some VMs); cpu ns are always given.
+ * Threads yield instead of spinning when idle, so it also runs on a
+ * box with fewer cpus than threads; pin them with taskset for numbers.
+ */
+
+#define DEFAULT_SEC        5
+#define DEFAULT_LEN        60
+#define DEFAULT_TXQ_KB     32
+#define DEFAULT_WINDOW_KB  64
+#define MAX_CTX            16
+#define PAGE_SZ            4096
+
+DEFINE_PER_CPU(struct ep_stats, ep_stats);
+struct ep_hwm ep_hwm;
+
+struct param {
+  const char *name;
+  int *val;
+};
+
+static const struct param params[] = {
+  { "tx_budget_min", &tx_budget_min },
+  { "tx_budget_max", &tx_budget_max },
+  { "tx_db_bytes", &tx_db_bytes },
+  { "tx_db_pkts", &tx_db_pkts },
+  { "tx_db_usecs", &tx_db_usecs },
+  { "tx_quantum", &tx_quantum },
+  { "tx_sched", &tx_sched },
+  { "tx_wc_simd", &tx_wc_simd },
+  { "lat_hist", &lat_hist },
+};
+#define NR_PARAMS  (sizeof(params) / sizeof(params[0]))
+
+static volatile int stop;
+static int frame_len = DEFAULT_LEN;
+static int npkt = 1;
+static int validate;
+static uint64_t nic_rate;          /* bytes per second, 0: unlimited */
+
+static uint32_t nic_regs[64];      /* mmio0 */
+static uint64_t nic_pkts, nic_bytes, nic_err;
+
+struct producer {
+  pthread_t th;
+  struct ep_ctx *ctx;
+  uint64_t pkts;
+  uint64_t writes;
+  uint64_t cpu_ns;
+  uint64_t cycles;
+};
+
+/* cycles of the calling thread, -1 without perf counters */
+static int cycles_open(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cycles_read(int fd)
+{
+  uint64_t val;
+
+  if ((fd < 0) || (read(fd, &val, sizeof(val)) != sizeof(val)))
+    return 0;
+
+  return val;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+      "usage: ep_bench [-t sec] [-l frame_len] [-n pkts_per_write] [-c contexts]\n"
+      "                [-q txq_kb] [-w window_kb] [-r nic_mbps] [-v] [-o name=value ...]\n");
+  exit(1);
+}
+
+static int set_param(char *arg)
+{
+  char *eq = strchr(arg, '=');
+  unsigned int i;
+
+  if (eq == NULL)
+    return -1;
+  *eq++ = '\0';
+
+  for (i = 0; i < NR_PARAMS; i++) {
+    if (0 == strcmp(arg, params[i].name)) {
+      *params[i].val = (int)strtol(eq, NULL, 0);
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "unknown parameter: %s\n", arg);
+  return -1;
+}
+
+/* what ethpipe_nic_init() does with the BARs */
+static int nic_init(uint32_t window)
+{
+  struct ecp3versa *nic = &pdev->nic;
+
+  nic->mmio0.virt = (uint8_t *)nic_regs;
+  nic->mmio0.len = sizeof(nic_regs);
+  if ((nic->mmio1.virt = aligned_alloc(PAGE_SZ, window)) == NULL)
+    return -1;
+  memset(nic->mmio1.virt, 0, window);
+  nic->mmio1.len = (uint64_t)window << 1;
+
+  nic->tx.start = (uint32_t *)nic->mmio0.virt;
+  nic->tx.write = (uint32_t *)(nic->mmio0.virt + TX0_WRITE_ADDR);
+  nic->tx.read = (uint32_t *)(nic->mmio0.virt + TX0_READ_ADDR);
+  nic->tx.size = nic->mmio1.len >> 1;
+  nic->tx.mask = nic->tx.size - 1;
+
+  spin_lock_init(&pdev->arb.lock);
+  pdev->arb.hw_write = read_nic_txptr((uint32_t *)nic->tx.write);
+  pdev->arb.hw_commit = pdev->arb.hw_write;
+  pdev->arb.hw_read = read_nic_txptr((uint32_t *)nic->tx.read);
+
+  return 0;
+}
+
+/* what ethpipe_ctx_alloc() does, without the kernel allocators */
+static struct ep_ctx *ctx_alloc(struct ep_txq *q)
+{
+  uint32_t slack = ALIGN(pdev->txq_size + EP_HDR_SIZE + MAX_PKT_SIZE, PAGE_SZ);
+  struct ep_ctx *ctx;
+
+  if ((ctx = aligned_alloc(64, ALIGN(sizeof(*ctx), 64))) == NULL)
+    return NULL;
+  memset(ctx, 0, sizeof(*ctx));
+
+  ctx->q = q;
+  ctx->tx_avg_len = MIN_PKT_SIZE;
+
+  ctx->txq_mem.size = PAGE_SZ + slack;
+  if ((ctx->txq_mem.virt = aligned_alloc(PAGE_SZ, ctx->txq_mem.size)) == NULL) {
+    free(ctx);
+    return NULL;
+  }
+  memset(ctx->txq_mem.virt, 0, ctx->txq_mem.size);
+  ctx->txctl = (struct ep_ring_ctl *)ctx->txq_mem.virt;
+  ctx->txctl->size = pdev->txq_size;
+  ctx->txctl->slack = slack - pdev->txq_size;
+  ctx->txctl->data_off = PAGE_SZ;
+  spin_lock_init(&ctx->lat_lock);
+
+  ctx->txq.start = (uint8_t *)ctx->txq_mem.virt + PAGE_SZ;
+  ctx->txq.size = pdev->txq_size;
+  ctx->txq.mask = pdev->txq_size - 1;
+  ctx->txq.end = ctx->txq.start + pdev->txq_size - 1;
+  ring_reset(&ctx->txq);
+
+  list_add_tail(&ctx->list, &q->ctx_list);
+
+  return ctx;
+}
+
+/*
+ * bench_write: the record loop of ethpipe_write(), memcpy() standing in
+ * for copy_from_user() and a yield for the wait on a full txq.
+ * returns the number of records queued.
+ */
+static int bench_write(struct ep_ctx *ctx, const uint8_t *buf, size_t count)
+{
+  struct ep_ring *txq = &ctx->txq;
+  uint16_t frame_len, len;
+  size_t done = 0;
+  uint8_t *rec;
+  int npkts = 0;
+
+  while (done + EP_HDR_SIZE <= count) {
+    frame_len = ep_rec_frame_len(buf + done);
+    if (frame_len == 0)
+      break;
+    len = EP_HDR_SIZE + frame_len;
+    if (done + len > count)
+      break;
+
+    while ((rec = ring_reserve(txq, len)) == NULL) {
+      if (stop)
+        return npkts;
+      sched_yield();
+    }
+
+    memcpy(rec, buf + done, len);
+    if (lat_hist && !ACCESS_ONCE(ctx->lat_rec))
+      lat_ingest_mark(ctx, rec);
+    ring_commit(txq, rec, len);
+
+    done += len;
+    ++npkts;
+  }
+
+  return npkts;
+}
+
+static void *producer(void *arg)
+{
+  struct producer *p = arg;
+  uint32_t size = ALIGN(EP_HDR_SIZE + frame_len, EP_RING_ALIGN);
+  uint64_t cpu0;
+  uint8_t *buf, *rec;
+  int i, j, fd;
+
+  // npkt records back to back, as pktgen writes them
+  if ((buf = calloc(npkt, size)) == NULL)
+    return NULL;
+  for (i = 0, rec = buf; i < npkt; i++, rec += EP_HDR_SIZE + frame_len) {
+    ep_rec_set_hdr(rec, frame_len, 0);
+    for (j = 0; j < frame_len; j++)
+      rec[EP_HDR_SIZE + j] = (uint8_t)j;
+  }
+
+  fd = cycles_open();
+  cpu0 = thread_cpu_ns();
+  while (!stop) {
+    p->pkts += bench_write(p->ctx, buf, (EP_HDR_SIZE + frame_len) * npkt);
+    p->writes++;
+  }
+  p->cpu_ns = thread_cpu_ns() - cpu0;
+  p->cycles = cycles_read(fd);
+  if (fd >= 0)
+    close(fd);
+
+  free(buf);
+
+  return NULL;
+}
+
+static uint8_t nic_byte(uint32_t off)
+{
+  return pdev->nic.mmio1.virt[off & pdev->nic.tx.mask];
+}
+
+/* the FPGA: read frames up to the doorbell and return the space */
+static void *nic(void *arg)
+{
+  struct ecp3versa *nic = &pdev->nic;
+  uint32_t wr, rd = 0, len;
+  uint64_t t0 = 0, budget = 0;
+
+  (void)arg;
+
+  if (nic_rate)
+    t0 = ktime_get();
+
+  while (!stop) {
+    wr = __atomic_load_n(nic->tx.write, __ATOMIC_ACQUIRE) << 1;
+    if (wr == rd) {
+      sched_yield();
+      continue;
+    }
+
+    if (!validate && !nic_rate) {
+      rd = wr;
+    } else {
+      if (nic_rate)
+        budget = (ktime_get() - t0) * nic_rate / 1000000000ULL - nic_bytes;
+      while (rd != wr) {
+        len = ((uint32_t)nic_byte(rd) << 8) | nic_byte(rd + 1);
+        if (validate && ((len != (uint32_t)frame_len) ||
+            (nic_byte(rd + EP_HWHDR_SIZE) != 0) ||
+            (nic_byte(rd + EP_HWHDR_SIZE + len - 1) != (uint8_t)(len - 1)))) {
+          nic_err++;
+          rd = wr;    // resync at the doorbell
+          break;
+        }
+        if (nic_rate && (len > budget))
+          break;
+        budget -= len;
+        nic_pkts++;
+        nic_bytes += len;
+        rd = (rd + hwtx_frame_size(len)) & nic->tx.mask;
+      }
+    }
+
+    __atomic_store_n(nic->tx.read, rd >> 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  struct producer prod[MAX_CTX];
+  pthread_t nic_th;
+  struct ep_txq *q;
+  unsigned int sec = DEFAULT_SEC, txq_kb = DEFAULT_TXQ_KB;
+  unsigned int window_kb = DEFAULT_WINDOW_KB;
+  int nr_ctx = 1, i, fd;
+  uint64_t loops = 0, idle = 0, produced = 0, writes = 0;
+  uint64_t cpu0, k_cpu_ns, k_cycles, w_cpu_ns = 0, w_cycles = 0, sent, busy;
+  s64 t0, t1, end;
+  double ns;
+
+  for (i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "-t")) {
+      if (++i == argc) usage();
+      sec = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-l")) {
+      if (++i == argc) usage();
+      frame_len = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-n")) {
+      if (++i == argc) usage();
+      npkt = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-c")) {
+      if (++i == argc) usage();
+      nr_ctx = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-q")) {
+      if (++i == argc) usage();
+      txq_kb = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-w")) {
+      if (++i == argc) usage();
+      window_kb = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-r")) {
+      if (++i == argc) usage();
+      nic_rate = strtoull(argv[i], NULL, 0) * 1000000ULL / 8;
+    } else if (0 == strcmp(argv[i], "-v")) {
+      validate = 1;
+    } else if (0 == strcmp(argv[i], "-o")) {
+      if (++i == argc || set_param(argv[i]) < 0) usage();
+    } else {
+      usage();
+    }
+  }
+  if ((frame_len < MIN_PKT_SIZE) || (frame_len > MAX_PKT_SIZE) ||
+      (npkt < 1) || (nr_ctx < 1) || (nr_ctx > MAX_CTX) ||
+      (txq_kb & (txq_kb - 1)) || (window_kb & (window_kb - 1)) ||
+      (txq_kb * 1024 <= RING_ALMOST_FULL) || (window_kb * 1024 <= MAX_PKT_SIZE)) {
+    fprintf(stderr, "bad frame length, batch, context count or ring size\n");
+    return 1;
+  }
+
+  if ((pdev = calloc(1, sizeof(*pdev))) == NULL)
+    return 1;
+  pdev->txq_size = txq_kb * 1024;
+  pdev->nr_txq = 1;
+  if (nic_init(window_kb * 1024) < 0)
+    return 1;
+
+  q = &pdev->txqs[0];
+  q->idx = 0;
+  spin_lock_init(&q->ctx_lock);
+  INIT_LIST_HEAD(&q->ctx_list);
+
+  for (i = 0; i < nr_ctx; i++) {
+    memset(&prod[i], 0, sizeof(prod[i]));
+    if ((prod[i].ctx = ctx_alloc(q)) == NULL)
+      return 1;
+  }
+
+  pthread_create(&nic_th, NULL, nic, NULL);
+  for (i = 0; i < nr_ctx; i++)
+    pthread_create(&prod[i].th, NULL, producer, &prod[i]);
+
+  // the TX kthread
+  fd = cycles_open();
+  cpu0 = thread_cpu_ns();
+  t0 = ktime_get();
+  end = t0 + (s64)sec * 1000000000LL;
+  do {
+    busy = ep_stats.cnt[EP_STAT_TX_BUSY];
+    if (!ethpipe_sched(q)) {
+      idle++;
+      sched_yield();
+    } else if (ep_stats.cnt[EP_STAT_TX_BUSY] != busy) {
+      sched_yield();    // NIC window full, let the NIC thread run
+    }
+  } while ((++loops & 0x3ff) || (ktime_get() < end));
+  t1 = ktime_get();
+  k_cpu_ns = thread_cpu_ns() - cpu0;
+  k_cycles = cycles_read(fd);
+
+  stop = 1;
+  for (i = 0; i < nr_ctx; i++) {
+    pthread_join(prod[i].th, NULL);
+    produced += prod[i].pkts;
+    writes += prod[i].writes;
+    w_cpu_ns += prod[i].cpu_ns;
+    w_cycles += prod[i].cycles;
+  }
+  pthread_join(nic_th, NULL);
+
+  ns = (double)(t1 - t0);
+  sent = ep_stats.cnt[EP_STAT_TX_PKTS];
+  if (sent == 0)
+    sent = 1;
+  printf("frame_len        %d\n", frame_len);
+  printf("pkts_per_write   %d\n", npkt);
+  printf("contexts         %d\n", nr_ctx);
+  printf("txq_kb           %u\n", txq_kb);
+  printf("window_kb        %u\n", window_kb);
+  printf("seconds          %.3f\n", ns / 1e9);
+  printf("writes           %llu\n", (unsigned long long)writes);
+  printf("queued           %llu\n", (unsigned long long)produced);
+  printf("sent             %llu\n", ep_stats.cnt[EP_STAT_TX_PKTS]);
+  printf("mpps             %.3f\n", ep_stats.cnt[EP_STAT_TX_PKTS] * 1e3 / ns);
+  printf("gbps             %.3f\n", ep_stats.cnt[EP_STAT_TX_BYTES] * 8 / ns);
+  printf("ns_per_pkt       %.1f\n", ns / sent);
+  printf("writer_cpu_ns    %.1f\n", (double)w_cpu_ns / sent);
+  printf("writer_cycles    %.1f\n", (double)w_cycles / sent);
+  printf("kthread_cpu_ns   %.1f\n", (double)k_cpu_ns / sent);
+  printf("kthread_cycles   %.1f\n", (double)k_cycles / sent);
+  printf("doorbells        %llu\n", ep_stats.cnt[EP_STAT_TX_DOORBELL]);
+  printf("ptr_reads        %llu\n", ep_stats.cnt[EP_STAT_TX_PTR_READ]);
+  printf("pkts_per_db      %.1f\n", ep_stats.cnt[EP_STAT_TX_DOORBELL] ?
+      (double)ep_stats.cnt[EP_STAT_TX_PKTS] / ep_stats.cnt[EP_STAT_TX_DOORBELL] : 0);
+  printf("tx_busy          %llu\n", ep_stats.cnt[EP_STAT_TX_BUSY]);
+  printf("tx_fmt_err       %llu\n", ep_stats.cnt[EP_STAT_TX_FMT_ERR]);
+  printf("idle_rounds      %llu\n", (unsigned long long)idle);
+  printf("nic_tx_hwm       %u\n", ep_hwm.nic_tx);
+  if (validate)
+    printf("nic_err          %llu\n", (unsigned long long)nic_err);
+
+  return (ep_stats.cnt[EP_STAT_TX_FMT_ERR] || nic_err) ? 1 : 0;
+}
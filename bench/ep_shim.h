@@ -0,0 +1,173 @@
+#ifndef _EP_SHIM_H_
+#define _EP_SHIM_H_
+
+/*
+ * Userspace stand-ins for the kernel API used by ethpipe.h,
+ * ethpipe_procfs.h and ethpipe_tx.h.  Just enough to run the TX
+ * datapath against the mock NIC of ep_bench.c; not a general shim.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <endian.h>
+
+#define KBUILD_MODNAME     "ethpipe"
+
+typedef uint8_t            u8;
+typedef uint16_t           u16;
+typedef uint32_t           u32;
+typedef unsigned long long u64;
+typedef long long          s64;
+typedef uint64_t           dma_addr_t;
+typedef s64                ktime_t;
+
+#define pr_info(fmt, ...)  fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_debug(fmt, ...) do { } while (0)
+#define printk(fmt, ...)   fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define ____cacheline_aligned_in_smp __attribute__((__aligned__(64)))
+#define __maybe_unused     __attribute__((__unused__))
+
+#define ALIGN(x, a)        (((x) + ((a) - 1)) & ~((__typeof__(x))(a) - 1))
+#define min(x, y)          ({ __typeof__(x) _x = (x); __typeof__(y) _y = (y); \
+                              _x < _y ? _x : _y; })
+#define max(x, y)          ({ __typeof__(x) _x = (x); __typeof__(y) _y = (y); \
+                              _x > _y ? _x : _y; })
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define NSEC_PER_USEC      1000L
+
+/* memory model: x86 and arm64 builds of the driver map onto these */
+#define ACCESS_ONCE(x)     (*(volatile __typeof__(x) *)&(x))
+#define barrier()          __asm__ __volatile__("" ::: "memory")
+#define smp_mb()           __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()          __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()          __atomic_thread_fence(__ATOMIC_RELEASE)
+#define wmb()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_load_acquire(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define cmpxchg(p, o, n)   __sync_val_compare_and_swap(p, o, n)
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()        __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()        __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()        barrier()
+#endif
+#define cond_resched()     sched_yield()
+
+#define cpu_to_be16(x)     htobe16(x)
+#define cpu_to_be64(x)     htobe64(x)
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/* time */
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#define ktime_to_ns(kt)    (kt)
+#define local_clock()      ((u64)ktime_get())
+
+/* spinlock: test and test-and-set */
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define spin_lock_init(l)  ((l)->locked = 0)
+
+static inline void spin_lock(spinlock_t *l)
+{
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+		while (ACCESS_ONCE(l->locked))
+			cpu_relax();
+	}
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+/* write() serialization is not part of the benchmark */
+struct mutex {
+	int unused;
+};
+
+#define atomic_read(v)     ACCESS_ONCE((v)->counter)
+#define atomic_set(v, i)   (ACCESS_ONCE((v)->counter) = (i))
+
+/* nobody sleeps in the benchmark */
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(q)     do { } while (0)
+#define waitqueue_active(q)        0
+#define wake_up_interruptible(q)   do { } while (0)
+#define wake_up_process(tsk)       do { } while (0)
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	new->prev = head->prev;
+	new->next = head;
+	head->prev->next = new;
+	head->prev = new;
+}
+
+#define list_for_each_entry(pos, head, member)                              \
+	for (pos = container_of((head)->next, __typeof__(*pos), member);       \
+	     &pos->member != (head);                                            \
+	     pos = container_of(pos->member.next, __typeof__(*pos), member))
+
+/* opaque in the datapath */
+struct pci_dev;
+struct task_struct;
+struct miscdevice {
+	const char *name;
+};
+struct semaphore {
+	int count;
+};
+
+/* per-cpu data: one copy per thread, so the hot path stays uncontended */
+#define DECLARE_PER_CPU(type, name)  extern __thread type name
+#define DEFINE_PER_CPU(type, name)   __thread type name
+#define this_cpu_add(var, val)       ((var) += (val))
+#define this_cpu_inc(var)            ((var)++)
+
+/* userspace may use the fpu anywhere */
+#define kernel_fpu_begin()   do { } while (0)
+#define kernel_fpu_end()     do { } while (0)
+
+/* tracepoints compile away */
+#define TP_PROTO(args...)  args
+#define TRACE_EVENT(name, proto, ...) \
+	static inline void trace_##name(proto) { }
+
+#endif /* _EP_SHIM_H_ */
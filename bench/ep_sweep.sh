@@ -0,0 +1,212 @@
+#!/bin/bash
+#
+# ep_sweep.sh: TX throughput over frame size, packets per write and
+# TX ring size, one CSV or JSON row per point
+#
+#   ep_sweep.sh [-b mock|dev] [-f csv|json] [-t sec] [-d dev] [-o file]
+#
+#   -b mock  bench/ep_bench: the driver's TX datapath against a mock
+#            NIC, no board needed (default)
+#   -b dev   pktgen into the loaded driver.  The TX ring size is set
+#            with ethpipe_ctl, counters come from /proc/driver/ethpipe/stats
+#            and cycles from perf stat on pktgen and ethpipe_tx/0
+#            (cpu time * cpu MHz without perf, as for mock in a VM)
+#
+# The points are taken from the environment:
+#   FRAMES="60 128 256 512 1024 1514 4096 9014"   frame length (bytes)
+#   BATCHES="1 8 41 256"                           records per write()
+#   RINGS="128 1024 8192"                          TX ring (KB)
+#
+# Columns: version, backend, frame_len, pkts_per_write, txq_kb, seconds,
+# pkts, mpps, gbps, writer_cycles, kthread_cycles (per packet).
+#
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+BACKEND=mock
+FORMAT=csv
+SEC=3
+DEV=/dev/ethpipe/0
+OUT=/dev/stdout
+
+FRAMES=${FRAMES:-"60 128 256 512 1024 1514 4096 9014"}
+BATCHES=${BATCHES:-"1 8 41 256"}
+RINGS=${RINGS:-"128 1024 8192"}
+
+EP_BENCH=${EP_BENCH:-$BENCH_DIR/ep_bench}
+PKTGEN=${PKTGEN:-$BENCH_DIR/../cmd/pktgen}
+ETHPIPE_CTL=${ETHPIPE_CTL:-$BENCH_DIR/../cmd/ethpipe_ctl}
+STATS=/proc/driver/ethpipe/stats
+
+COLUMNS="version backend frame_len pkts_per_write txq_kb seconds pkts mpps gbps writer_cycles kthread_cycles"
+
+usage() {
+	echo "usage: $0 [-b mock|dev] [-f csv|json] [-t sec] [-d dev] [-o file]" >&2
+	exit 1
+}
+
+while getopts "b:f:t:d:o:" opt; do
+	case $opt in
+	b) BACKEND=$OPTARG ;;
+	f) FORMAT=$OPTARG ;;
+	t) SEC=$OPTARG ;;
+	d) DEV=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ "$BACKEND" = mock -o "$BACKEND" = dev ] || usage
+[ "$FORMAT" = csv -o "$FORMAT" = json ] || usage
+
+# value of "name value" lines
+field() {
+	awk -v k="$2" '$1 == k { print $2; exit }' "$1"
+}
+
+# cpu MHz, to turn cpu time into cycles when perf is missing
+cpu_mhz() {
+	awk -F: '/^cpu MHz/ { printf "%d\n", $2; exit }' /proc/cpuinfo
+}
+
+# cycles in a perf stat -x, output file
+perf_cycles() {
+	awk -F, '$3 ~ /^cycles/ { print $1; exit }' "$1"
+}
+
+run_mock() {
+	local len=$1 npkt=$2 ring=$3 log
+	log=$(mktemp)
+
+	if ! "$EP_BENCH" -t "$SEC" -l "$len" -n "$npkt" -q "$ring" > "$log"; then
+		rm -f "$log"
+		return 1
+	fi
+
+	# no perf counters: cpu time * cpu MHz, as for -b dev
+	awk -v v="$VERSION" -v l="$len" -v n="$npkt" -v r="$ring" -v m="$(cpu_mhz)" '
+	{ f[$1] = $2 }
+	END {
+		if (f["writer_cycles"] == 0) {
+			f["writer_cycles"] = f["writer_cpu_ns"] * m / 1000
+			f["kthread_cycles"] = f["kthread_cpu_ns"] * m / 1000
+		}
+		printf "%s mock %d %d %d %s %s %s %s %.1f %.1f\n",
+			v, l, n, r, f["seconds"], f["sent"], f["mpps"], f["gbps"],
+			f["writer_cycles"], f["kthread_cycles"]
+	}' "$log"
+	rm -f "$log"
+}
+
+run_dev() {
+	local len=$1 npkt=$2 ring=$3
+	local loops kpid t0 t1 s0 s1 pkts bytes ns wcyc kcyc wlog klog tlog
+	local kt0 kt1 hz mhz
+
+	"$ETHPIPE_CTL" -d "$DEV" set txq_size=$(( ring * 1024 )) || return 1
+
+	# about SEC seconds of 10GbE line rate
+	loops=$(( SEC * 1250000000 / ((len + 24) * npkt) ))
+	[ "$loops" -lt 1 ] && loops=1
+
+	kpid=$(pgrep -x ethpipe_tx/0 | head -1)
+	wlog=$(mktemp)
+	klog=$(mktemp)
+	tlog=$(mktemp)
+	s0=$(mktemp)
+	s1=$(mktemp)
+
+	cat "$STATS" > "$s0"
+	if [ -n "$PERF" ]; then
+		"$PERF" stat -x, -e cycles -p "$kpid" -o "$klog" &
+		local perf_pid=$!
+	else
+		kt0=$(awk '{ print $14 + $15 }' /proc/"$kpid"/stat)
+	fi
+	t0=$(date +%s%N)
+
+	if [ -n "$PERF" ]; then
+		"$PERF" stat -x, -e cycles -o "$wlog" -- \
+			"$PKTGEN" -s "$len" -n "$npkt" -m "$loops" > "$DEV"
+	else
+		( TIMEFORMAT="%3U %3S"; time "$PKTGEN" -s "$len" -n "$npkt" \
+			-m "$loops" > "$DEV" ) 2> "$tlog"
+	fi
+
+	t1=$(date +%s%N)
+	cat "$STATS" > "$s1"
+	if [ -n "$PERF" ]; then
+		kill -INT "$perf_pid"
+		wait "$perf_pid" 2> /dev/null
+	else
+		kt1=$(awk '{ print $14 + $15 }' /proc/"$kpid"/stat)
+	fi
+
+	pkts=$(( $(field "$s1" tx_pkts) - $(field "$s0" tx_pkts) ))
+	bytes=$(( $(field "$s1" tx_bytes) - $(field "$s0" tx_bytes) ))
+	ns=$(( t1 - t0 ))
+	[ "$pkts" -lt 1 ] && pkts=1
+
+	if [ -n "$PERF" ]; then
+		wcyc=$(perf_cycles "$wlog")
+		kcyc=$(perf_cycles "$klog")
+	else
+		hz=$(getconf CLK_TCK)
+		mhz=$(cpu_mhz)
+		wcyc=$(awk -v m="$mhz" '{ printf "%.0f", ($1 + $2) * m * 1e6 }' "$tlog")
+		kcyc=$(awk -v t=$(( kt1 - kt0 )) -v h="$hz" -v m="$mhz" \
+			'BEGIN { printf "%.0f", t / h * m * 1e6 }')
+	fi
+
+	awk -v v="$VERSION" -v l="$len" -v n="$npkt" -v r="$ring" \
+		-v ns="$ns" -v p="$pkts" -v b="$bytes" -v w="${wcyc:-0}" -v k="${kcyc:-0}" \
+		'BEGIN { printf "%s dev %d %d %d %.3f %d %.3f %.3f %.1f %.1f\n",
+			v, l, n, r, ns / 1e9, p, p * 1e3 / ns, b * 8 / ns,
+			w / p, k / p }'
+
+	rm -f "$wlog" "$klog" "$tlog" "$s0" "$s1"
+}
+
+# space separated rows to CSV or JSON
+emit() {
+	if [ "$FORMAT" = csv ]; then
+		echo "$COLUMNS" | tr ' ' ','
+		tr ' ' ','
+	else
+		awk -v cols="$COLUMNS" '
+		BEGIN { n = split(cols, c, " "); printf "[" }
+		{
+			printf "%s\n  {", (NR > 1) ? "," : ""
+			for (i = 1; i <= n; i++) {
+				if (i <= 2)
+					printf "\"%s\": \"%s\"", c[i], $i
+				else
+					printf "\"%s\": %s", c[i], $i
+				printf "%s", (i < n) ? ", " : "}"
+			}
+		}
+		END { printf "\n]\n" }'
+	fi
+}
+
+if [ "$BACKEND" = mock ]; then
+	[ -x "$EP_BENCH" ] || make -C "$BENCH_DIR" > /dev/null || exit 1
+	VERSION=$(git -C "$BENCH_DIR" describe --always --dirty 2> /dev/null || echo unknown)
+else
+	[ -w "$DEV" ] || { echo "$DEV: not writable" >&2; exit 1; }
+	[ -x "$PKTGEN" ] || { echo "$PKTGEN: build cmd/pktgen_stdout.c" >&2; exit 1; }
+	[ -x "$ETHPIPE_CTL" ] || { echo "$ETHPIPE_CTL: build cmd/ethpipe_ctl.c" >&2; exit 1; }
+	VERSION=$(cat /sys/module/ethpipe/version 2> /dev/null || echo unknown)
+	PERF=$(command -v perf)
+fi
+
+for ring in $RINGS; do
+	for npkt in $BATCHES; do
+		for len in $FRAMES; do
+			echo "frame_len=$len pkts_per_write=$npkt txq_kb=$ring" >&2
+			if [ "$BACKEND" = mock ]; then
+				run_mock "$len" "$npkt" "$ring"
+			else
+				run_dev "$len" "$npkt" "$ring"
+			fi || echo "failed: frame_len=$len pkts_per_write=$npkt txq_kb=$ring" >&2
+		done
+	done
+done | emit > "$OUT"
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+/*
+ * ep_cat: replay files of EP records with sendfile(2)
+ *
+ *   ep_cat [-d dev] [-m nloop] file...
+ *
+ * The page cache feeds the TX ring of dev (default /dev/ethpipe/0)
+ * through the driver's splice_write, one copy and no userspace buffer.
+ * Records may cross page and sendfile() boundaries; the driver
+ * carries them over.
+ */
+
+#define DEFAULT_DEV    "/dev/ethpipe/0"
+#define CHUNK          (1 << 30)
+
+static int send_file(int out, const char *path)
+{
+  struct stat st;
+  off_t off = 0;
+  ssize_t cnt;
+  int in;
+
+  if ((in = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return -1;
+  }
+  if (fstat(in, &st) < 0) {
+    perror("fstat");
+    close(in);
+    return -1;
+  }
+
+  while (off < st.st_size) {
+    cnt = sendfile(out, in, &off,
+        (st.st_size - off < CHUNK) ? st.st_size - off : CHUNK);
+    if (cnt <= 0) {
+      if (cnt < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      perror("sendfile");
+      close(in);
+      return -1;
+    }
+  }
+
+  close(in);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *dev = DEFAULT_DEV;
+  unsigned int nloop = 1, n;
+  int out, i, first, ret = 0;
+
+  for (i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "-d")) {
+      if (++i == argc) perror("-d");
+      dev = argv[i];
+    } else if (0 == strcmp(argv[i], "-m")) {
+      if (++i == argc) perror("-m");
+      nloop = atoi(argv[i]);
+    } else {
+      break;
+    }
+  }
+  first = i;
+  if (first == argc) {
+    fprintf(stderr, "usage: %s [-d dev] [-m nloop] file...\n", argv[0]);
+    return 1;
+  }
+
+  if ((out = open(dev, O_WRONLY)) < 0) {
+    perror(dev);
+    return 1;
+  }
+
+  for (n = 0; n < nloop && ret == 0; n++) {
+    for (i = first; i < argc && ret == 0; i++)
+      ret = send_file(out, argv[i]);
+  }
+
+  close(out);
+
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <byteswap.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * ep_replay: replay a pcap or pcapng capture to /dev/ethpipe/N
+ *
+ *   ep_replay [-d dev] [-x speed] [-m nloop] [-b batch_kb] file
+ *
+ *   -x speed   capture time is divided by speed (2 = twice as fast).
+ *              0 sends back to back: every pd_time is 0
+ *   -m nloop   replay the capture nloop times
+ *   -b kb      bytes of records per write() (default 1024 KB)
+ *
+ * The capture is mmap()ed and each Ethernet frame becomes one record:
+ * pd_hdr + frame, padded to 60 bytes, and to the original length when
+ * the capture was truncated.  pd_time is the capture time since the
+ * first frame, in 8 ns units; the first frame of each loop has the
+ * reset bit, so every loop starts on its own time base.  Load the
+ * driver with tx_sched=1 to have frames released at their pd_time.
+ */
+
+#define DEFAULT_DEV    "/dev/ethpipe/0"
+#define DEFAULT_BATCH  1024          /* KB */
+
+#define PKTDEV_HDR_LEN 12
+#define PKTDEV_MAGIC   0x3776
+#define MIN_FRAME_LEN  60
+#define MAX_FRAME_LEN  9014
+
+#define TS_TICK_NS     8
+#define TS_VAL_MASK    ((1ULL << 48) - 1)
+#define TS_RESET       (1ULL << 63)
+
+#define LINKTYPE_ETHERNET  1
+
+/* pcap */
+#define PCAP_MAGIC_US      0xa1b2c3d4
+#define PCAP_MAGIC_NS      0xa1b23c4d
+#define PCAP_HDR_LEN       24
+#define PCAP_REC_LEN       16
+
+/* pcapng */
+#define PCAPNG_SHB         0x0a0d0d0a
+#define PCAPNG_IDB         0x00000001
+#define PCAPNG_PB          0x00000002    /* obsolete packet block */
+#define PCAPNG_SPB         0x00000003
+#define PCAPNG_EPB         0x00000006
+#define PCAPNG_BOM         0x1a2b3c4d
+#define PCAPNG_IF_TSRESOL  9
+#define PCAPNG_MAX_IF      64
+
+struct pcapng_if {
+  uint16_t linktype;
+  uint32_t snaplen;
+  bool tsres_bin;          /* units of 2^-tsres s, else 10^-tsres s */
+  uint8_t tsres;
+};
+
+struct replay {
+  const uint8_t *map;
+  size_t maplen;
+
+  /* pcap, or the current pcapng section */
+  bool swap;
+  bool ng;
+  bool nsec;               /* pcap: nanosecond timestamps */
+  uint32_t linktype;       /* pcap */
+  struct pcapng_if ifs[PCAPNG_MAX_IF];
+  int nif;
+
+  /* timestamp mapping */
+  double speed;
+  bool first;
+  uint64_t base_ns;        /* capture time of pd_time 0 */
+
+  /* write() batch */
+  int fd;
+  uint8_t *buf;
+  size_t buflen;
+  size_t len;
+
+  unsigned long long pkts, bytes, skipped;
+};
+
+static inline uint16_t rd16(const struct replay *r, const uint8_t *p)
+{
+  uint16_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return r->swap ? bswap_16(v) : v;
+}
+
+static inline uint32_t rd32(const struct replay *r, const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return r->swap ? bswap_32(v) : v;
+}
+
+static int flush(struct replay *r)
+{
+  const uint8_t *ptr = r->buf;
+  size_t nleft = r->len;
+  ssize_t cnt;
+
+  while (nleft > 0) {
+    if ((cnt = write(r->fd, ptr, nleft)) <= 0) {
+      if (cnt < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      perror("write");
+      return -1;
+    }
+    nleft -= cnt;
+    ptr += cnt;
+  }
+  r->len = 0;
+
+  return 0;
+}
+
+/* pd_time of a frame captured at ns */
+static inline uint64_t pd_time(struct replay *r, uint64_t ns)
+{
+  uint64_t val;
+
+  if (r->speed == 0)
+    return 0;
+
+  if (r->first) {
+    r->first = false;
+    r->base_ns = ns;
+    return TS_RESET;
+  }
+
+  // out of order captures are sent at once
+  if (ns < r->base_ns)
+    return 0;
+  val = (uint64_t)((ns - r->base_ns) / r->speed) / TS_TICK_NS;
+
+  // past the 48 bits of pd_time: start a new time base here
+  if (val > TS_VAL_MASK) {
+    r->base_ns = ns;
+    return TS_RESET;
+  }
+
+  return val;
+}
+
+/* one frame to a record of the batch */
+static inline int put_frame(struct replay *r, const uint8_t *data,
+    uint32_t caplen, uint32_t origlen, uint64_t ns)
+{
+  uint32_t frame_len = (origlen > caplen) ? origlen : caplen;
+  uint16_t v16;
+  uint64_t v64;
+  uint8_t *rec;
+
+  if (frame_len > MAX_FRAME_LEN) {
+    r->skipped++;
+    return 0;
+  }
+  if (frame_len < MIN_FRAME_LEN)
+    frame_len = MIN_FRAME_LEN;
+
+  if (r->len + PKTDEV_HDR_LEN + frame_len > r->buflen && flush(r) < 0)
+    return -1;
+
+  rec = r->buf + r->len;
+  v16 = htole16(PKTDEV_MAGIC);
+  memcpy(rec, &v16, 2);
+  v16 = htole16(frame_len);
+  memcpy(rec + 2, &v16, 2);
+  v64 = htole64(pd_time(r, ns));
+  memcpy(rec + 4, &v64, 8);
+  memcpy(rec + PKTDEV_HDR_LEN, data, caplen);
+  if (frame_len > caplen)
+    memset(rec + PKTDEV_HDR_LEN + caplen, 0, frame_len - caplen);
+
+  r->len += PKTDEV_HDR_LEN + frame_len;
+  r->pkts++;
+  r->bytes += frame_len;
+
+  return 0;
+}
+
+static int replay_pcap(struct replay *r)
+{
+  const uint8_t *p = r->map + PCAP_HDR_LEN;
+  const uint8_t *end = r->map + r->maplen;
+  uint32_t caplen, origlen;
+  uint64_t ns;
+
+  if (r->linktype != LINKTYPE_ETHERNET) {
+    fprintf(stderr, "linktype %u: only Ethernet is supported\n", r->linktype);
+    return -1;
+  }
+
+  while (p + PCAP_REC_LEN <= end) {
+    caplen = rd32(r, p + 8);
+    origlen = rd32(r, p + 12);
+    if (p + PCAP_REC_LEN + caplen > end)
+      break;
+
+    // the next record header, while this frame is copied
+    __builtin_prefetch(p + PCAP_REC_LEN + caplen + PCAP_REC_LEN);
+
+    ns = (uint64_t)rd32(r, p) * 1000000000ULL +
+      (uint64_t)rd32(r, p + 4) * (r->nsec ? 1 : 1000);
+    if (put_frame(r, p + PCAP_REC_LEN, caplen, origlen, ns) < 0)
+      return -1;
+
+    p += PCAP_REC_LEN + caplen;
+  }
+
+  return 0;
+}
+
+/* pcapng timestamp of interface ifp to ns */
+static inline uint64_t ng_ns(const struct pcapng_if *ifp, uint64_t ts)
+{
+  static const uint64_t pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL,
+  };
+
+  if (ifp->tsres_bin && ifp->tsres < 64)
+    return (uint64_t)(((unsigned __int128)ts * 1000000000ULL) >> ifp->tsres);
+  if (ifp->tsres_bin)
+    return 0;
+  if (ifp->tsres <= 9)
+    return ts * pow10[9 - ifp->tsres];
+  if (ifp->tsres <= 18)
+    return ts / pow10[ifp->tsres - 9];
+  return 0;
+}
+
+static void ng_idb(struct replay *r, const uint8_t *body, uint32_t blen)
+{
+  struct pcapng_if *ifp;
+  const uint8_t *opt, *end = body + blen;
+  uint16_t code, olen;
+
+  if (r->nif == PCAPNG_MAX_IF || blen < 8)
+    return;
+
+  ifp = &r->ifs[r->nif++];
+  ifp->linktype = rd16(r, body);
+  ifp->snaplen = rd32(r, body + 4);
+  ifp->tsres_bin = false;
+  ifp->tsres = 6;
+
+  for (opt = body + 8; opt + 4 <= end; opt += 4 + ((olen + 3) & ~3)) {
+    code = rd16(r, opt);
+    olen = rd16(r, opt + 2);
+    if (code == 0)
+      break;
+    if (code == PCAPNG_IF_TSRESOL && olen >= 1 && opt + 5 <= end) {
+      ifp->tsres_bin = !!(opt[4] & 0x80);
+      ifp->tsres = opt[4] & 0x7f;
+    }
+  }
+}
+
+static int replay_pcapng(struct replay *r)
+{
+  const uint8_t *p = r->map;
+  const uint8_t *end = r->map + r->maplen;
+  const uint8_t *body;
+  const struct pcapng_if *ifp;
+  uint32_t type, blen, ifid, caplen, origlen;
+  uint64_t ns = 0;
+
+  while (p + 12 <= end) {
+    // a section header sets the byte order of what follows
+    memcpy(&type, p, 4);
+    if (type == PCAPNG_SHB) {
+      uint32_t bom;
+
+      memcpy(&bom, p + 8, 4);
+      r->swap = (bom != PCAPNG_BOM);
+      r->nif = 0;
+    }
+    blen = rd32(r, p + 4);
+    if (blen < 12 || (blen & 3) || p + blen > end)
+      break;
+    body = p + 8;
+
+    // the next block header, while this one is copied
+    __builtin_prefetch(p + blen);
+    __builtin_prefetch(p + blen + 64);
+
+    type = rd32(r, p);
+    switch (type) {
+    case PCAPNG_IDB:
+      ng_idb(r, body, blen - 12);
+      break;
+    case PCAPNG_EPB:
+    case PCAPNG_PB:
+      if (blen < 32)
+        break;
+      ifid = (type == PCAPNG_EPB) ? rd32(r, body) : rd16(r, body);
+      caplen = rd32(r, body + 12);
+      origlen = rd32(r, body + 16);
+      if (ifid >= r->nif || 20 + caplen > blen - 12)
+        break;
+      ifp = &r->ifs[ifid];
+      if (ifp->linktype != LINKTYPE_ETHERNET) {
+        r->skipped++;
+        break;
+      }
+      ns = ng_ns(ifp, ((uint64_t)rd32(r, body + 4) << 32) | rd32(r, body + 8));
+      if (put_frame(r, body + 20, caplen, origlen, ns) < 0)
+        return -1;
+      break;
+    case PCAPNG_SPB:
+      // no timestamp: sent along with the previous frame
+      if (r->nif == 0 || blen < 16)
+        break;
+      ifp = &r->ifs[0];
+      origlen = rd32(r, body);
+      caplen = origlen;
+      if (ifp->snaplen && caplen > ifp->snaplen)
+        caplen = ifp->snaplen;
+      if (caplen > blen - 16)
+        caplen = blen - 16;
+      if (ifp->linktype != LINKTYPE_ETHERNET) {
+        r->skipped++;
+        break;
+      }
+      if (put_frame(r, body + 4, caplen, origlen, ns) < 0)
+        return -1;
+      break;
+    default:
+      break;
+    }
+
+    p += blen;
+  }
+
+  return 0;
+}
+
+static int replay_open(struct replay *r, const char *path)
+{
+  struct stat st;
+  uint32_t magic;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < PCAP_HDR_LEN) {
+    fprintf(stderr, "%s: not a capture\n", path);
+    close(fd);
+    return -1;
+  }
+  r->maplen = st.st_size;
+  r->map = mmap(NULL, r->maplen, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (r->map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise((void *)r->map, r->maplen, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  memcpy(&magic, r->map, 4);
+  if (magic == PCAPNG_SHB) {
+    r->ng = true;
+    return 0;
+  }
+  if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+    r->swap = false;
+  } else if (magic == bswap_32(PCAP_MAGIC_US) || magic == bswap_32(PCAP_MAGIC_NS)) {
+    r->swap = true;
+    magic = bswap_32(magic);
+  } else {
+    fprintf(stderr, "%s: not a pcap or pcapng file\n", path);
+    munmap((void *)r->map, r->maplen);
+    return -1;
+  }
+  r->nsec = (magic == PCAP_MAGIC_NS);
+  r->linktype = rd32(r, r->map + 20) & 0xffff;
+
+  return 0;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  static struct replay r;
+  const char *dev = DEFAULT_DEV;
+  const char *path = NULL;
+  unsigned int nloop = 1, batch = DEFAULT_BATCH, n;
+  double t0, t1;
+  int i, ret = 0;
+
+  r.speed = 1.0;
+
+  for (i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "-d")) {
+      if (++i == argc) perror("-d");
+      dev = argv[i];
+    } else if (0 == strcmp(argv[i], "-x")) {
+      if (++i == argc) perror("-x");
+      r.speed = atof(argv[i]);
+    } else if (0 == strcmp(argv[i], "-m")) {
+      if (++i == argc) perror("-m");
+      nloop = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-b")) {
+      if (++i == argc) perror("-b");
+      batch = atoi(argv[i]);
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == NULL || r.speed < 0) {
+    fprintf(stderr, "usage: %s [-d dev] [-x speed] [-m nloop] [-b batch_kb] file\n",
+        argv[0]);
+    return 1;
+  }
+
+  // a batch holds at least one record of any size
+  r.buflen = (size_t)batch * 1024;
+  if (r.buflen < PKTDEV_HDR_LEN + MAX_FRAME_LEN)
+    r.buflen = PKTDEV_HDR_LEN + MAX_FRAME_LEN;
+  if ((r.buf = malloc(r.buflen)) == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  if (replay_open(&r, path) < 0) {
+    free(r.buf);
+    return 1;
+  }
+  if ((r.fd = open(dev, O_WRONLY)) < 0) {
+    perror(dev);
+    ret = -1;
+    goto out;
+  }
+
+  t0 = now_sec();
+  for (n = 0; n < nloop && ret == 0; n++) {
+    r.first = true;
+    ret = r.ng ? replay_pcapng(&r) : replay_pcap(&r);
+  }
+  if (ret == 0)
+    ret = flush(&r);
+  t1 = now_sec();
+
+  fprintf(stderr, "pkts=%llu bytes=%llu skipped=%llu loops=%u sec=%.3f mpps=%.3f\n",
+      r.pkts, r.bytes, r.skipped, n, t1 - t0,
+      (t1 > t0) ? r.pkts / (t1 - t0) / 1e6 : 0.0);
+
+  close(r.fd);
+out:
+  munmap((void *)r.map, r.maplen);
+  free(r.buf);
+
+  return ret ? 1 : 0;
+}
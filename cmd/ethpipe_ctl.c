@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "../ethpipe_uapi.h"
+
+/*
+ * ethpipe_ctl: query and retune the driver at runtime (see ethpipe_uapi.h)
+ *
+ *   ethpipe_ctl [-d dev] show
+ *   ethpipe_ctl [-d dev] set name=value ...
+ *   ethpipe_ctl [-d dev] cpu <txq index|rx> <cpu|-1>
+ *   ethpipe_ctl [-d dev] stats
+ */
+
+#define DEFAULT_DEV    "/dev/ethpipe/0"
+
+struct param {
+  const char *name;
+  size_t off;
+  int is_signed;
+};
+
+#define P_U32(f)  { #f, offsetof(struct ep_ioc_params, f), 0 }
+#define P_S32(f)  { #f, offsetof(struct ep_ioc_params, f), 1 }
+
+static const struct param params[] = {
+  P_U32(txq_size),
+  P_U32(rxq_size),
+  P_U32(nr_txq),
+  P_S32(tx_budget_min),
+  P_S32(tx_budget_max),
+  P_S32(tx_db_bytes),
+  P_S32(tx_db_pkts),
+  P_S32(tx_db_usecs),
+  P_S32(tx_quantum),
+  P_S32(tx_sched),
+  P_S32(tx_sched_spin_ns),
+  P_S32(busy_poll),
+  P_S32(tx_spin_us),
+  P_S32(rx_spin_us),
+  P_S32(rx_poll_us),
+};
+#define NR_PARAMS  (sizeof(params) / sizeof(params[0]))
+
+static void usage(void)
+{
+  fprintf(stderr,
+      "usage: ethpipe_ctl [-d dev] show\n"
+      "       ethpipe_ctl [-d dev] set name=value ...\n"
+      "       ethpipe_ctl [-d dev] cpu <txq index|rx> <cpu|-1>\n"
+      "       ethpipe_ctl [-d dev] stats\n");
+  exit(1);
+}
+
+static int show(int fd)
+{
+  struct ep_ioc_params p;
+  struct ep_ioc_cpu c;
+  unsigned int i;
+  uint32_t *v;
+
+  if (ioctl(fd, EP_IOC_GET_PARAMS, &p) < 0) {
+    perror("EP_IOC_GET_PARAMS");
+    return -1;
+  }
+
+  for (i = 0; i < NR_PARAMS; i++) {
+    v = (uint32_t *)((char *)&p + params[i].off);
+    if (params[i].is_signed)
+      printf("%s=%d\n", params[i].name, (int32_t)*v);
+    else
+      printf("%s=%u\n", params[i].name, *v);
+  }
+
+  for (i = 0; i < p.nr_txq; i++) {
+    c.queue = i;
+    if (ioctl(fd, EP_IOC_GET_CPU, &c) == 0)
+      printf("tx%u_cpu=%d\n", i, c.cpu);
+  }
+  c.queue = EP_IOC_RXQ;
+  if (ioctl(fd, EP_IOC_GET_CPU, &c) == 0)
+    printf("rx_cpu=%d\n", c.cpu);
+
+  return 0;
+}
+
+static int set(int fd, int argc, char **argv)
+{
+  struct ep_ioc_params p;
+  unsigned int i;
+  char *eq;
+  int n;
+
+  if (ioctl(fd, EP_IOC_GET_PARAMS, &p) < 0) {
+    perror("EP_IOC_GET_PARAMS");
+    return -1;
+  }
+
+  for (n = 0; n < argc; n++) {
+    eq = strchr(argv[n], '=');
+    if (eq == NULL)
+      usage();
+    *eq++ = '\0';
+
+    for (i = 0; i < NR_PARAMS; i++) {
+      if (0 == strcmp(argv[n], params[i].name))
+        break;
+    }
+    if (i == NR_PARAMS) {
+      fprintf(stderr, "unknown parameter: %s\n", argv[n]);
+      return -1;
+    }
+    *(uint32_t *)((char *)&p + params[i].off) = (uint32_t)strtol(eq, NULL, 0);
+  }
+
+  if (ioctl(fd, EP_IOC_SET_PARAMS, &p) < 0) {
+    perror("EP_IOC_SET_PARAMS");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int cpu(int fd, const char *queue, const char *cpu)
+{
+  struct ep_ioc_cpu c;
+
+  if (0 == strcmp(queue, "rx"))
+    c.queue = EP_IOC_RXQ;
+  else
+    c.queue = (uint32_t)atoi(queue);
+  c.cpu = atoi(cpu);
+
+  if (ioctl(fd, EP_IOC_SET_CPU, &c) < 0) {
+    perror("EP_IOC_SET_CPU");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int stats(int fd)
+{
+  struct ep_ioc_stats st;
+  unsigned int i;
+
+  if (ioctl(fd, EP_IOC_GET_STATS, &st) < 0) {
+    perror("EP_IOC_GET_STATS");
+    return -1;
+  }
+
+  for (i = 0; i < st.nr_txq; i++)
+    printf("tx%u_pkts=%llu\n", i, (unsigned long long)st.tx_pkts[i]);
+  printf("rx_pkts=%llu\n", (unsigned long long)st.rx_pkts);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *dev = DEFAULT_DEV;
+  int fd, ret, i = 1;
+
+  if ((argc > 2) && (0 == strcmp(argv[1], "-d"))) {
+    dev = argv[2];
+    i = 3;
+  }
+  if (i >= argc)
+    usage();
+
+  if ((fd = open(dev, O_RDONLY)) < 0) {
+    perror(dev);
+    return 1;
+  }
+
+  if (0 == strcmp(argv[i], "show"))
+    ret = show(fd);
+  else if (0 == strcmp(argv[i], "set") && (i + 1 < argc))
+    ret = set(fd, argc - i - 1, &argv[i + 1]);
+  else if (0 == strcmp(argv[i], "cpu") && (i + 2 < argc))
+    ret = cpu(fd, argv[i + 1], argv[i + 2]);
+  else if (0 == strcmp(argv[i], "stats"))
+    ret = stats(fd);
+  else
+    usage();
+
+  close(fd);
+
+  return ret ? 1 : 0;
+}
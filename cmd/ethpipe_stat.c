@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * ethpipe_stat: per-second rates of /proc/driver/ethpipe/stats
+ *
+ *   ethpipe_stat [-i interval_sec] [-c count] [-f stats_file] [-l]
+ *
+ * Counters are printed as a rate per second, *_hwm lines (ring
+ * high-water marks in bytes) as they are.  With -l, percentiles of
+ * the latency histograms (load the driver with lat_hist=1) over each
+ * interval follow.  They are bucket upper bounds, so within 2x.
+ */
+
+#define DEFAULT_STATS  "/proc/driver/ethpipe/stats"
+#define DEFAULT_LAT    "/proc/driver/ethpipe/latency"
+#define MAX_LAT        3
+#define LAT_BUCKETS    32
+#define MAX_STATS      64
+#define NAME_LEN       32
+
+struct stat_ent {
+  char name[NAME_LEN];
+  unsigned long long val;
+};
+
+static int read_stats(const char *path, struct stat_ent *ent)
+{
+  FILE *fp;
+  int n = 0;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  while (n < MAX_STATS &&
+      fscanf(fp, "%31s %llu", ent[n].name, &ent[n].val) == 2)
+    n++;
+
+  fclose(fp);
+
+  return n;
+}
+
+struct lat_hist {
+  char name[NAME_LEN];
+  unsigned long long hi[LAT_BUCKETS];
+  unsigned long long cnt[LAT_BUCKETS];
+};
+
+/* "name lo_ns hi_ns count" lines, see ethpipe_procfs.c */
+static int read_lat(const char *path, struct lat_hist *h)
+{
+  char name[NAME_LEN];
+  unsigned long long lo, hi, cnt;
+  FILE *fp;
+  int n = 0, i, b;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  memset(h, 0, sizeof(*h) * MAX_LAT);
+  while (fscanf(fp, "%31s %llu %llu %llu", name, &lo, &hi, &cnt) == 4) {
+    for (i = 0; i < n; i++) {
+      if (0 == strcmp(h[i].name, name))
+        break;
+    }
+    if (i == n) {
+      if (n == MAX_LAT)
+        continue;
+      strcpy(h[n++].name, name);
+    }
+    for (b = 0; lo >> b; b++)
+      ;
+    if (b < LAT_BUCKETS) {
+      h[i].hi[b] = hi;
+      h[i].cnt[b] = cnt;
+    }
+  }
+
+  fclose(fp);
+
+  return n;
+}
+
+static unsigned long long lat_pct(const unsigned long long *cnt,
+    const unsigned long long *hi, unsigned long long total, double pct)
+{
+  unsigned long long sum = 0;
+  int b;
+
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    sum += cnt[b];
+    if (sum && sum >= total * pct)
+      return hi[b];
+  }
+
+  return 0;
+}
+
+static void print_lat(const struct lat_hist *cur, const struct lat_hist *prev,
+    int n)
+{
+  unsigned long long cnt[LAT_BUCKETS], hi[LAT_BUCKETS], total;
+  int i, j, b;
+
+  for (i = 0; i < n; i++) {
+    // histograms may appear in a different order once they get samples
+    for (j = 0; j < MAX_LAT; j++) {
+      if (0 == strcmp(prev[j].name, cur[i].name))
+        break;
+    }
+
+    total = 0;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      cnt[b] = cur[i].cnt[b] - ((j < MAX_LAT) ? prev[j].cnt[b] : 0);
+      hi[b] = cur[i].hi[b];
+      total += cnt[b];
+    }
+    if (total == 0)
+      continue;
+
+    printf("%-16s n=%llu p50<=%lluns p99<=%lluns p99.9<=%lluns max<=%lluns\n",
+        cur[i].name, total,
+        lat_pct(cnt, hi, total, 0.5), lat_pct(cnt, hi, total, 0.99),
+        lat_pct(cnt, hi, total, 0.999), lat_pct(cnt, hi, total, 1.0));
+  }
+}
+
+static int is_hwm(const char *name)
+{
+  size_t len = strlen(name);
+
+  return (len > 4) && (0 == strcmp(name + len - 4, "_hwm"));
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  struct stat_ent prev[MAX_STATS], cur[MAX_STATS];
+  struct lat_hist lprev[MAX_LAT], lcur[MAX_LAT];
+  const char *path = DEFAULT_STATS;
+  unsigned int interval = 1;
+  int count = -1, n, m, i, lat = 0, ln = 0;
+  double t0, t1;
+
+  for (i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "-i")) {
+      if (++i == argc) perror("-i");
+      interval = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-c")) {
+      if (++i == argc) perror("-c");
+      count = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-f")) {
+      if (++i == argc) perror("-f");
+      path = argv[i];
+    } else if (0 == strcmp(argv[i], "-l")) {
+      lat = 1;
+    }
+  }
+  if (interval < 1)
+    interval = 1;
+
+  if ((n = read_stats(path, prev)) < 0)
+    return 1;
+  if (lat && (read_lat(DEFAULT_LAT, lprev) < 0))
+    return 1;
+  t0 = now_sec();
+
+  while (count < 0 || count-- > 0) {
+    sleep(interval);
+
+    if ((m = read_stats(path, cur)) != n) {
+      fprintf(stderr, "stats layout changed\n");
+      return 1;
+    }
+    t1 = now_sec();
+
+    for (i = 0; i < n; i++) {
+      if (is_hwm(cur[i].name))
+        printf("%-16s %14llu\n", cur[i].name, cur[i].val);
+      else
+        printf("%-16s %14.0f/s\n", cur[i].name,
+            (cur[i].val - prev[i].val) / (t1 - t0));
+    }
+    if (lat && ((ln = read_lat(DEFAULT_LAT, lcur)) >= 0)) {
+      print_lat(lcur, lprev, ln);
+      memcpy(lprev, lcur, sizeof(lprev));
+    }
+    printf("\n");
+    fflush(stdout);
+
+    memcpy(prev, cur, sizeof(prev));
+    t0 = t1;
+  }
+
+  return 0;
+}
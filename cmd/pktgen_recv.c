@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+/*
+ * pktgen_recv: check the frames of pktgen_stdout on the receive side
+ *
+ *   pktgen_recv [-d dev | -I ifname] [-i interval_sec] [-c count] [-b batch_kb]
+ *
+ *   -d dev     EP records from read() of dev (default /dev/ethpipe/0),
+ *              or of any file or pipe of records (-d /dev/stdin)
+ *   -I ifname  frames from an AF_PACKET TPACKET_V3 ring on ifname
+ *
+ * Frames are matched on PKTGEN_MAGIC in the UDP payload.  pg_id gives
+ * loss, duplicates and reordering (within a window of SEQ_WINDOW ids
+ * behind the highest id seen), pg_time one-way latency and its jitter
+ * (RFC 3550).  pktgen_stdout stamps pg_time with CLOCK_REALTIME once
+ * per batch, and frames are timed on arrival with the socket timestamp
+ * (-I) or when read() returns (-d), so latency includes batching on
+ * both sides and needs synchronized clocks across hosts.
+ *
+ * One line per interval, and totals on exit (SIGINT or -c).  Latency
+ * percentiles are bucket upper bounds, so within 2x.
+ */
+
+#define PKTGEN_MAGIC   0xbe9be955
+#define PKTDEV_HDR_LEN 12
+#define PKTDEV_MAGIC   0x3776
+#define MAX_FRAME_LEN  9014
+
+#define DEFAULT_DEV    "/dev/ethpipe/0"
+#define DEFAULT_BATCH  1024          /* KB */
+#define SEQ_WINDOW     65536         /* ids, power of two */
+#define LAT_BUCKETS    40
+
+/* TPACKET_V3 ring */
+#define RING_BLOCK_SIZE  (1 << 22)
+#define RING_BLOCK_NR    64
+#define RING_FRAME_SIZE  2048
+#define RING_RETIRE_MS   10
+
+struct pg_hdr {
+  uint32_t pg_magic;
+  uint32_t pg_id;
+  uint64_t pg_time;
+} __attribute__((packed));
+
+struct counters {
+  unsigned long long frames;   /* all frames */
+  unsigned long long pkts;     /* pktgen frames */
+  unsigned long long bytes;
+  unsigned long long dup;
+  unsigned long long reorder;  /* arrived behind a higher id */
+  unsigned long long stale;    /* behind the window: dup or reorder */
+  unsigned long long lat_n;
+  unsigned long long lat_neg;  /* pg_time in the future: clock skew */
+  unsigned long long lat_sum;
+  unsigned long long lat_min;
+  unsigned long long lat_max;
+  unsigned long long lat[LAT_BUCKETS];
+};
+
+struct checker {
+  /* ids: 64-bit extension of pg_id, and the window behind the highest */
+  bool started;
+  uint64_t first;
+  uint64_t max;
+  uint8_t seen[SEQ_WINDOW / 8];
+
+  /* RFC 3550 jitter */
+  bool transit_valid;
+  int64_t transit;
+  double jitter;
+
+  struct counters tot, cur;
+};
+
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+  done = 1;
+}
+
+static inline uint64_t now_ns(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int lat_bucket(uint64_t ns)
+{
+  int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+  return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+static inline void count_lat(struct counters *c, uint64_t lat)
+{
+  c->lat_n++;
+  c->lat_sum += lat;
+  if (c->lat_n == 1 || lat < c->lat_min)
+    c->lat_min = lat;
+  if (lat > c->lat_max)
+    c->lat_max = lat;
+  c->lat[lat_bucket(lat)]++;
+}
+
+static inline void seen_clear(struct checker *k, uint64_t from, uint64_t to)
+{
+  uint64_t id;
+
+  if (to - from >= SEQ_WINDOW) {
+    memset(k->seen, 0, sizeof(k->seen));
+    return;
+  }
+  for (id = from; id != to; id++)
+    k->seen[(id & (SEQ_WINDOW - 1)) >> 3] &= ~(1 << (id & 7));
+}
+
+/* test and set the id in the window */
+static inline bool seen_test_set(struct checker *k, uint64_t id)
+{
+  uint8_t *p = &k->seen[(id & (SEQ_WINDOW - 1)) >> 3];
+  uint8_t bit = 1 << (id & 7);
+  bool was = !!(*p & bit);
+
+  *p |= bit;
+  return was;
+}
+
+/* one pktgen frame: pg_id and pg_time (network order), arrival in ns */
+static inline void check_pg(struct checker *k, uint32_t pg_id, uint64_t pg_time,
+    uint64_t rx_ns, uint16_t len)
+{
+  uint64_t id, tx_ns;
+  int64_t transit, d;
+  int32_t diff;
+
+  k->cur.pkts++;
+  k->cur.bytes += len;
+
+  // extend pg_id to 64 bits around the highest id seen
+  if (!k->started) {
+    k->started = true;
+    k->first = k->max = id = pg_id;
+    seen_test_set(k, id);
+  } else {
+    diff = (int32_t)(pg_id - (uint32_t)k->max);
+    id = k->max + diff;
+    if (diff > 0) {
+      seen_clear(k, k->max + 1, id);
+      k->max = id;
+      seen_test_set(k, id);
+    } else if (k->max - id >= SEQ_WINDOW || id < k->first) {
+      k->cur.stale++;
+    } else if (seen_test_set(k, id)) {
+      k->cur.dup++;
+    } else {
+      k->cur.reorder++;
+    }
+  }
+
+  // one-way latency and jitter
+  tx_ns = be64toh(pg_time);
+  if (tx_ns == 0)
+    return;
+  if (rx_ns < tx_ns) {
+    k->cur.lat_neg++;
+    return;
+  }
+  count_lat(&k->cur, rx_ns - tx_ns);
+
+  transit = rx_ns - tx_ns;
+  if (k->transit_valid) {
+    d = transit - k->transit;
+    if (d < 0)
+      d = -d;
+    k->jitter += (d - k->jitter) / 16;
+  }
+  k->transit = transit;
+  k->transit_valid = true;
+}
+
+/* an Ethernet frame: is it pktgen's? */
+static inline void check_frame(struct checker *k, const uint8_t *f, uint32_t len,
+    uint64_t rx_ns)
+{
+  const struct pg_hdr *pg;
+  uint32_t off = 12, ihl;
+  uint16_t type;
+
+  k->cur.frames++;
+
+  // ethertype, past VLAN tags
+  for (;;) {
+    if (off + 2 > len)
+      return;
+    type = (f[off] << 8) | f[off + 1];
+    off += 2;
+    if (type != ETH_P_8021Q && type != ETH_P_8021AD)
+      break;
+    off += 2;
+  }
+  if (type != ETH_P_IP || off + 20 > len || (f[off] >> 4) != 4)
+    return;
+  ihl = (f[off] & 0xf) * 4;
+  if (f[off + 9] != IPPROTO_UDP || off + ihl + 8 + sizeof(*pg) > len)
+    return;
+
+  pg = (const struct pg_hdr *)(f + off + ihl + 8);
+  if (pg->pg_magic != htonl(PKTGEN_MAGIC))
+    return;
+
+  check_pg(k, ntohl(pg->pg_id), pg->pg_time, rx_ns, len);
+}
+
+static unsigned long long lat_pct(const struct counters *c, double pct)
+{
+  unsigned long long sum = 0;
+  int b;
+
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    sum += c->lat[b];
+    if (sum && sum >= c->lat_n * pct)
+      return (1ULL << b) - 1;
+  }
+
+  return 0;
+}
+
+static void report(const char *tag, const struct checker *k,
+    const struct counters *c, double sec)
+{
+  // expected ids of the interval are not known; loss is for the totals
+  printf("%-6s frames=%llu pkts=%llu mpps=%.3f gbps=%.3f dup=%llu reorder=%llu stale=%llu",
+      tag, c->frames, c->pkts, c->pkts / sec / 1e6, c->bytes * 8 / sec / 1e9,
+      c->dup, c->reorder, c->stale);
+  if (c == &k->tot) {
+    unsigned long long expect = k->started ? k->max - k->first + 1 : 0;
+    unsigned long long uniq = c->pkts - c->dup - c->stale;
+
+    printf(" expect=%llu lost=%lld", expect,
+        (long long)expect - (long long)uniq);
+  }
+  if (c->lat_n)
+    printf(" lat_min=%lluns lat_avg=%lluns lat_max=%lluns p50<=%lluns"
+        " p99<=%lluns p99.9<=%lluns jitter=%.0fns",
+        c->lat_min, c->lat_sum / c->lat_n, c->lat_max, lat_pct(c, 0.5),
+        lat_pct(c, 0.99), lat_pct(c, 0.999), k->jitter);
+  if (c->lat_neg)
+    printf(" lat_neg=%llu", c->lat_neg);
+  printf("\n");
+  fflush(stdout);
+}
+
+/* fold the interval into the totals */
+static void roll(struct checker *k)
+{
+  struct counters *t = &k->tot, *c = &k->cur;
+  int b;
+
+  t->frames += c->frames;
+  t->pkts += c->pkts;
+  t->bytes += c->bytes;
+  t->dup += c->dup;
+  t->reorder += c->reorder;
+  t->stale += c->stale;
+  t->lat_neg += c->lat_neg;
+  if (c->lat_n) {
+    if (t->lat_n == 0 || c->lat_min < t->lat_min)
+      t->lat_min = c->lat_min;
+    if (c->lat_max > t->lat_max)
+      t->lat_max = c->lat_max;
+    t->lat_n += c->lat_n;
+    t->lat_sum += c->lat_sum;
+    for (b = 0; b < LAT_BUCKETS; b++)
+      t->lat[b] += c->lat[b];
+  }
+  memset(c, 0, sizeof(*c));
+}
+
+/*
+ * EP records from read(): whole records from the device, a record cut
+ * by the end of a read() of a file or pipe is carried to the next one
+ */
+static int recv_dev(struct checker *k, const char *dev, size_t buflen,
+    unsigned int interval, int count)
+{
+  uint8_t *buf;
+  size_t have = 0, off;
+  uint16_t magic, len;
+  uint64_t rx_ns, t0, t1;
+  ssize_t cnt;
+  int fd;
+
+  if ((fd = open(dev, O_RDONLY)) < 0) {
+    perror(dev);
+    return -1;
+  }
+  if ((buf = malloc(buflen)) == NULL) {
+    perror("malloc");
+    close(fd);
+    return -1;
+  }
+
+  t0 = now_ns(CLOCK_MONOTONIC);
+  while (!done) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    if (poll(&pfd, 1, 100) > 0) {
+      if ((cnt = read(fd, buf + have, buflen - have)) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        perror("read");
+        break;
+      }
+      if (cnt == 0)
+        done = 1;
+      rx_ns = now_ns(CLOCK_REALTIME);
+      have += cnt;
+
+      for (off = 0; off + PKTDEV_HDR_LEN <= have; off += PKTDEV_HDR_LEN + len) {
+        memcpy(&magic, buf + off, 2);
+        memcpy(&len, buf + off + 2, 2);
+        magic = le16toh(magic);
+        len = le16toh(len);
+        if (magic != PKTDEV_MAGIC || len > MAX_FRAME_LEN) {
+          fprintf(stderr, "record format error: magic=%X len=%d\n", magic, len);
+          done = 1;
+          break;
+        }
+        if (off + PKTDEV_HDR_LEN + len > have)
+          break;
+        check_frame(k, buf + off + PKTDEV_HDR_LEN, len, rx_ns);
+      }
+      memmove(buf, buf + off, have - off);
+      have -= off;
+    }
+
+    t1 = now_ns(CLOCK_MONOTONIC);
+    if (t1 - t0 >= interval * 1000000000ULL) {
+      report("intvl", k, &k->cur, (t1 - t0) / 1e9);
+      roll(k);
+      t0 = t1;
+      if (count > 0 && --count == 0)
+        done = 1;
+    }
+  }
+
+  free(buf);
+  close(fd);
+
+  return 0;
+}
+
+/* frames from a TPACKET_V3 ring: one poll() per filled block */
+static int recv_if(struct checker *k, const char *ifname, unsigned int interval,
+    int count)
+{
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll, *sl;
+  struct tpacket_block_desc *bd;
+  struct tpacket3_hdr *th;
+  uint8_t *ring;
+  uint64_t t0, t1;
+  unsigned int blk = 0, i;
+  int fd, ver = TPACKET_V3;
+
+  if ((fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0) {
+    perror("PACKET_VERSION");
+    close(fd);
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = RING_BLOCK_SIZE;
+  req.tp_block_nr = RING_BLOCK_NR;
+  req.tp_frame_size = RING_FRAME_SIZE;
+  req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_NR;
+  req.tp_retire_blk_tov = RING_RETIRE_MS;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    perror("PACKET_RX_RING");
+    close(fd);
+    return -1;
+  }
+  ring = mmap(NULL, (size_t)RING_BLOCK_SIZE * RING_BLOCK_NR,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+  if (ring == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  if ((sll.sll_ifindex = if_nametoindex(ifname)) == 0 ||
+      bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    perror(ifname);
+    munmap(ring, (size_t)RING_BLOCK_SIZE * RING_BLOCK_NR);
+    close(fd);
+    return -1;
+  }
+
+  t0 = now_ns(CLOCK_MONOTONIC);
+  while (!done) {
+    bd = (struct tpacket_block_desc *)(ring + (size_t)blk * RING_BLOCK_SIZE);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLERR };
+
+      poll(&pfd, 1, 100);
+    } else {
+      th = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+      for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+        sl = (struct sockaddr_ll *)((uint8_t *)th +
+            TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        // frames sent from this host show up too
+        if (sl->sll_pkttype != PACKET_OUTGOING)
+          check_frame(k, (uint8_t *)th + th->tp_mac, th->tp_snaplen,
+              (uint64_t)th->tp_sec * 1000000000ULL + th->tp_nsec);
+        th = (struct tpacket3_hdr *)((uint8_t *)th + th->tp_next_offset);
+      }
+      // hand the block back to the kernel
+      __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+      blk = (blk + 1) % RING_BLOCK_NR;
+    }
+
+    t1 = now_ns(CLOCK_MONOTONIC);
+    if (t1 - t0 >= interval * 1000000000ULL) {
+      report("intvl", k, &k->cur, (t1 - t0) / 1e9);
+      roll(k);
+      t0 = t1;
+      if (count > 0 && --count == 0)
+        done = 1;
+    }
+  }
+
+  munmap(ring, (size_t)RING_BLOCK_SIZE * RING_BLOCK_NR);
+  close(fd);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  static struct checker k;
+  const char *dev = DEFAULT_DEV;
+  const char *ifname = NULL;
+  unsigned int interval = 1, batch = DEFAULT_BATCH;
+  int count = -1, i, ret;
+  uint64_t t0;
+
+  for (i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "-d")) {
+      if (++i == argc) perror("-d");
+      dev = argv[i];
+    } else if (0 == strcmp(argv[i], "-I")) {
+      if (++i == argc) perror("-I");
+      ifname = argv[i];
+    } else if (0 == strcmp(argv[i], "-i")) {
+      if (++i == argc) perror("-i");
+      interval = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-c")) {
+      if (++i == argc) perror("-c");
+      count = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-b")) {
+      if (++i == argc) perror("-b");
+      batch = atoi(argv[i]);
+    }
+  }
+  if (interval < 1)
+    interval = 1;
+  if ((size_t)batch * 1024 < PKTDEV_HDR_LEN + MAX_FRAME_LEN)
+    batch = (PKTDEV_HDR_LEN + MAX_FRAME_LEN + 1023) / 1024;
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  t0 = now_ns(CLOCK_MONOTONIC);
+  if (ifname)
+    ret = recv_if(&k, ifname, interval, count);
+  else
+    ret = recv_dev(&k, dev, (size_t)batch * 1024, interval, count);
+
+  roll(&k);
+  report("total", &k, &k.tot, (now_ns(CLOCK_MONOTONIC) - t0) / 1e9);
+
+  return ret ? 1 : 0;
+}
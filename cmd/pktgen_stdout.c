@@ -6,6 +6,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
@@ -14,6 +20,8 @@
 #define __FAVOR_BSD
 #include <netinet/udp.h>
 
+#include "../ethpipe_uapi.h"
+
 
 #define PKTGEN_MAGIC   0xbe9be955
 #define ETH_DST_MAC    0x020000000002
@@ -33,6 +41,10 @@
 
 #define PKTDEV_MAGIC   0x3776
 
+#ifndef IOV_MAX
+#define IOV_MAX        1024
+#endif
+
 /* from netmap pkt-gen.c */
 static uint16_t checksum(const void * data, uint16_t len, uint32_t sum)
 {
@@ -183,48 +195,484 @@ void set_pghdr(struct pktgen_pkt *pkt)
   return;
 };
 
-//#define step 0xEE6B280
-unsigned short id = 0;
-unsigned long long ts = 0;
-static inline void build_pack(char *pack, struct pktgen_pkt *pkt,
-    unsigned int npkt, int pktlen, unsigned int step)
+/*
+ * Template engine
+ *
+ * Every flow (5-tuple) has a template of all headers with ip_len and
+ * ip_id 0, and the IP checksum of that.  Per frame only the length
+ * fields, ip_id, ip_sum (RFC 1624 update from the template sum),
+ * pg_id, pg_time and pd_time change.  pg_time is CLOCK_REALTIME in ns
+ * (big endian) when the batch was built, for pktgen_recv.  Pack buffers keep what is laid in each
+ * record slot, so a slot that gets the same flow and size again only
+ * has these fields rewritten.
+ */
+#define MAX_FLOWS      65536
+#define MAX_SIZES      16
+#define MAX_PATTERN    256
+#define WIRE_OVERHEAD  24      /* preamble 8 + FCS 4 + IFG 12 */
+
+struct pg_flow {
+  struct pktgen_pkt tmpl;
+  uint16_t sum0;               /* ip_sum of tmpl, host order */
+};
+
+struct pg_size {
+  uint16_t frame_len;
+  unsigned int step;           /* wire time at mbps, pd_time units */
+};
+
+/* what lies in a record slot of a pack buffer */
+struct pg_slot {
+  uint32_t off;
+  uint16_t frame_len;          /* 0: nothing yet */
+  int flow;
+  uint16_t sum;                /* ip_sum of the slot with ip_id 0 */
+};
+
+struct pg_engine {
+  struct pg_flow *flows;
+  int nflow;
+  int next_flow;
+
+  /* frame sizes, sent in pattern order */
+  struct pg_size sizes[MAX_SIZES];
+  int nsize;
+  uint8_t pattern[MAX_PATTERN];
+  int npattern;
+  int next_size;
+  uint16_t max_len;
+
+  uint32_t id;                 /* pg_id, ip_id is its low 16 bits */
+  unsigned long long ts;
+  bool reset;                  /* the next frame restarts the time base */
+  uint64_t pg_time;            /* of this batch, big endian */
+};
+
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), host order */
+static inline uint16_t csum_update(uint16_t hc, uint16_t m, uint16_t m1)
+{
+  uint32_t sum = (uint16_t)~hc + (uint16_t)~m + m1;
+
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum & 0xFFFF;
+}
+
+/* lo[-hi] of IPv4 addresses, host order */
+static int parse_ip_range(const char *arg, uint32_t *lo, uint32_t *hi)
 {
-	struct ip *ip;
-  int i, offset;
+  char buf[64], *sep;
+  struct in_addr a;
+
+  snprintf(buf, sizeof(buf), "%s", arg);
+  if ((sep = strchr(buf, '-')) != NULL)
+    *sep++ = '\0';
+  if (inet_pton(AF_INET, buf, &a) != 1)
+    return -1;
+  *lo = *hi = ntohl(a.s_addr);
+  if (sep) {
+    if (inet_pton(AF_INET, sep, &a) != 1)
+      return -1;
+    *hi = ntohl(a.s_addr);
+  }
 
-  ip = (struct ip *)&pkt->ip;
+  return (*lo <= *hi) ? 0 : -1;
+}
+
+/* lo[-hi] of UDP ports */
+static int parse_port_range(const char *arg, uint32_t *lo, uint32_t *hi)
+{
+  char *end;
+
+  *lo = *hi = strtoul(arg, &end, 0);
+  if (*end == '-')
+    *hi = strtoul(end + 1, &end, 0);
+
+  return (*end == '\0' && *lo <= *hi && *hi <= 0xFFFF) ? 0 : -1;
+}
+
+/* every combination of the ranges, source port varying fastest */
+static int pg_flows_init(struct pg_engine *e, const uint32_t *sip,
+    const uint32_t *dip, const uint32_t *sport, const uint32_t *dport)
+{
+  unsigned long long n;
+  struct pktgen_pkt base;
+  struct pg_flow *fl;
+  uint32_t s, d, sp, dp;
+
+  n = (unsigned long long)(sip[1] - sip[0] + 1) * (dip[1] - dip[0] + 1) *
+    (sport[1] - sport[0] + 1) * (dport[1] - dport[0] + 1);
+  if (n > MAX_FLOWS) {
+    fprintf(stderr, "too many flows: %llu (max %d)\n", n, MAX_FLOWS);
+    return -1;
+  }
+  if ((e->flows = malloc(sizeof(struct pg_flow) * n)) == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  set_pdhdr(&base, 0);
+  base.pd.pd_time.reset = 0;
+  set_ethhdr(&base);
+  set_ip4hdr(&base, ETH_HDR_LEN);
+  set_udphdr(&base, ETH_HDR_LEN + IP4_HDR_LEN);
+  set_pghdr(&base);
+
+  fl = e->flows;
+  for (s = sip[0]; s <= sip[1] && s >= sip[0]; s++) {
+    for (d = dip[0]; d <= dip[1] && d >= dip[0]; d++) {
+      for (dp = dport[0]; dp <= dport[1]; dp++) {
+        for (sp = sport[0]; sp <= sport[1]; sp++, fl++) {
+          fl->tmpl = base;
+          fl->tmpl.ip.ip_src.s_addr = htonl(s);
+          fl->tmpl.ip.ip_dst.s_addr = htonl(d);
+          fl->tmpl.udp.uh_sport = htons(sp);
+          fl->tmpl.udp.uh_dport = htons(dp);
+          fl->sum0 = ntohs(wrapsum(checksum(&fl->tmpl.ip, IP4_HDR_LEN, 0)));
+        }
+      }
+    }
+  }
+  e->nflow = n;
+
+  return 0;
+}
 
-  offset = 0;
+/*
+ * frame sizes: "len[:weight],..." or "imix" (60:7,590:4,1514:1).
+ * the pattern interleaves them by smooth weighted round robin.
+ */
+static int pg_sizes_init(struct pg_engine *e, const char *spec, unsigned int mbps)
+{
+  char buf[256], *tok, *save, *w;
+  int weight[MAX_SIZES], cur[MAX_SIZES];
+  int total = 0, i, n, best;
+
+  if (0 == strcmp(spec, "imix"))
+    spec = "60:7,590:4,1514:1";
+  snprintf(buf, sizeof(buf), "%s", spec);
+
+  e->nsize = 0;
+  e->max_len = 0;
+  for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    if (e->nsize == MAX_SIZES) {
+      fprintf(stderr, "too many frame sizes (max %d)\n", MAX_SIZES);
+      return -1;
+    }
+    i = e->nsize++;
+    weight[i] = 1;
+    if ((w = strchr(tok, ':')) != NULL) {
+      *w++ = '\0';
+      weight[i] = atoi(w);
+    }
+    e->sizes[i].frame_len = atoi(tok);
+    if (e->sizes[i].frame_len < 60 || e->sizes[i].frame_len > 9014) {
+      fprintf(stderr, "frame size error: %s\n", tok);
+      return -1;
+    }
+    if (weight[i] < 1) {
+      fprintf(stderr, "weight error: %s\n", w);
+      return -1;
+    }
+    e->sizes[i].step = (unsigned int)((e->sizes[i].frame_len + WIRE_OVERHEAD) *
+        (1000 / (float)mbps));
+    if (e->sizes[i].frame_len > e->max_len)
+      e->max_len = e->sizes[i].frame_len;
+    total += weight[i];
+  }
+  if (e->nsize == 0 || total > MAX_PATTERN) {
+    fprintf(stderr, "frame size error: %s\n", spec);
+    return -1;
+  }
+
+  memset(cur, 0, sizeof(cur));
+  for (n = 0; n < total; n++) {
+    best = 0;
+    for (i = 0; i < e->nsize; i++) {
+      cur[i] += weight[i];
+      if (cur[i] > cur[best])
+        best = i;
+    }
+    cur[best] -= total;
+    e->pattern[n] = best;
+  }
+  e->npattern = total;
+
+  return 0;
+}
+
+/* flow and size of the next frame */
+static inline void pg_next(struct pg_engine *e, int *flow, int *size)
+{
+  *flow = e->next_flow;
+  if (++e->next_flow == e->nflow)
+    e->next_flow = 0;
+  *size = e->pattern[e->next_size];
+  if (++e->next_size == e->npattern)
+    e->next_size = 0;
+}
+
+/* headers of flow at frame_len. returns ip_sum with ip_id 0 */
+static inline uint16_t pg_lay(const struct pg_engine *e, struct pktgen_pkt *pkt,
+    int flow, uint16_t frame_len)
+{
+  memcpy(pkt, &e->flows[flow].tmpl, sizeof(struct pktgen_pkt));
+  pkt->pd.pd_frame_len = frame_len;
+  pkt->ip.ip_len = htons(frame_len - ETH_HDR_LEN);
+  pkt->udp.uh_ulen = htons(frame_len - ETH_HDR_LEN - IP4_HDR_LEN);
+
+  return csum_update(e->flows[flow].sum0, 0, frame_len - ETH_HDR_LEN);
+}
+
+/* pg_time of the frames of the next batch */
+static inline void pg_clock(struct pg_engine *e)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  e->pg_time = htobe64((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+/* per frame fields */
+static inline void pg_stamp(struct pg_engine *e, struct pktgen_pkt *pkt,
+    uint16_t sum, unsigned int step)
+{
+  pkt->pd.pd_time.val_low = e->ts & 0xFFFFFFFF;
+  pkt->pd.pd_time.val_high = (e->ts >> 32) & 0xFFFF;
+  pkt->pd.pd_time.reset = e->reset;
+  e->reset = false;
+  pkt->ip.ip_id = htons(e->id & 0xFFFF);
+  pkt->ip.ip_sum = htons(csum_update(sum, 0, e->id & 0xFFFF));
+  pkt->pg.pg_id = htonl(e->id++);
+  pkt->pg.pg_time = e->pg_time;
+  e->ts += step;
+}
+
+/* npkt records into pack. returns the bytes laid down */
+static inline int build_pack(struct pg_engine *e, char *pack,
+    struct pg_slot *slots, unsigned int npkt)
+{
+  struct pktgen_pkt *rec;
+  struct pg_slot *s;
+  uint32_t off = 0;
+  uint16_t len;
+  int i, flow, size;
+
+  pg_clock(e);
   for (i = 0; i < npkt; i++) {
-    ip->ip_id = htons(id);
-    pkt->pd.pd_time.val_low = ts & 0xFFFFFFFF;
-    pkt->pd.pd_time.val_high = (ts >> 32) & 0xFFFF;
-    pkt->pg.pg_id = htonl((u_int32_t)id++);
-    ip->ip_sum = wrapsum(checksum(ip, sizeof(*ip), 0));
-    //pkt->ip.ip_sum = 0;
-    memcpy(pack + offset, pkt, sizeof(struct pktgen_pkt));
-    pkt->pd.pd_time.reset = 0;
-    offset += pktlen;
-    ts += step;
+    pg_next(e, &flow, &size);
+    len = e->sizes[size].frame_len;
+    s = &slots[i];
+    rec = (struct pktgen_pkt *)(pack + off);
+
+    if (s->off != off || s->frame_len != len) {
+      // the layout moved: the whole record
+      s->sum = pg_lay(e, rec, flow, len);
+      memset((char *)rec + sizeof(struct pktgen_pkt), 0,
+          PKTDEV_HDR_LEN + len - sizeof(struct pktgen_pkt));
+      s->off = off;
+      s->frame_len = len;
+      s->flow = flow;
+    } else if (s->flow != flow) {
+      // same place and size, another flow: the headers
+      s->sum = pg_lay(e, rec, flow, len);
+      s->flow = flow;
+    }
+    pg_stamp(e, rec, s->sum, e->sizes[size].step);
+
+    off += PKTDEV_HDR_LEN + len;
+  }
+
+  return off;
+}
+
+/*
+ * writev() variant of build_pack: one header per record, all pointing
+ * at the same zeroed payload, so no per-frame payload copy
+ */
+static inline void build_iov(struct pg_engine *e, struct pktgen_pkt *hdrs,
+    struct pg_slot *slots, struct iovec *iov, const char *pad, unsigned int npkt)
+{
+  struct pg_slot *s;
+  uint16_t len;
+  int i, flow, size;
+
+  pg_clock(e);
+  for (i = 0; i < npkt; i++) {
+    pg_next(e, &flow, &size);
+    len = e->sizes[size].frame_len;
+    s = &slots[i];
+    if (s->frame_len != len || s->flow != flow) {
+      s->sum = pg_lay(e, &hdrs[i], flow, len);
+      s->frame_len = len;
+      s->flow = flow;
+    }
+    pg_stamp(e, &hdrs[i], s->sum, e->sizes[size].step);
+
+    iov[i * 2].iov_base = &hdrs[i];
+    iov[i * 2].iov_len = sizeof(struct pktgen_pkt);
+    iov[i * 2 + 1].iov_base = (void *)pad;
+    iov[i * 2 + 1].iov_len = PKTDEV_HDR_LEN + len - sizeof(struct pktgen_pkt);
+  }
+}
+
+/* writev() all of iov, IOV_MAX at a time, resuming after short writes */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t cnt;
+
+  while (iovcnt > 0) {
+    if ((cnt = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) <= 0) {
+      if (cnt < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      perror("writev");
+      return -1;
+    }
+    while (iovcnt > 0 && cnt >= (ssize_t)iov->iov_len) {
+      cnt -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + cnt;
+      iov->iov_len -= cnt;
+    }
+  }
+
+  return 0;
+}
+
+/* mmap()ed TX ring of /dev/ethpipe/N */
+struct ep_txring {
+  int fd;
+  void *map;
+  size_t maplen;
+  volatile struct ep_ring_ctl *ctl;
+  uint8_t *data;
+  uint32_t mask;
+};
+
+static int txring_open(struct ep_txring *r, const char *dev)
+{
+  struct ep_ring_ctl ctl;
+  long pgsize = sysconf(_SC_PAGESIZE);
+  void *p;
+  int fd;
+
+  if ((fd = open(dev, O_RDWR)) < 0) {
+    perror("open");
+    return -1;
+  }
+
+  // the control page tells how large the whole mapping is
+  p = mmap(NULL, pgsize, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  memcpy(&ctl, p, sizeof(ctl));
+  munmap(p, pgsize);
+
+  r->maplen = ctl.data_off + ctl.size + ctl.slack;
+  r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (r->map == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  r->fd = fd;
+  r->ctl = r->map;
+  r->data = (uint8_t *)r->map + ctl.data_off;
+  r->mask = ctl.size - 1;
+
+  return 0;
+}
+
+static void txring_close(struct ep_txring *r)
+{
+  munmap(r->map, r->maplen);
+  close(r->fd);
+}
+
+/* lay down npkt records straight into the TX ring */
+static inline void build_ring(struct pg_engine *e, struct ep_txring *r,
+    unsigned int npkt)
+{
+  struct pktgen_pkt *rec;
+  uint32_t wr, rd;
+  uint16_t len, sum;
+  int i, flow, size;
+
+  pg_clock(e);
+  wr = r->ctl->write;
+  for (i = 0; i < npkt; i++) {
+    // wait for the TX kthread to make room
+    rd = __atomic_load_n(&r->ctl->read, __ATOMIC_ACQUIRE);
+    if (((rd - wr - 1) & r->mask) < EP_RING_RESERVE) {
+      struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+
+      __atomic_store_n(&r->ctl->write, wr, __ATOMIC_RELEASE);
+      do {
+        poll(&pfd, 1, -1);
+        rd = __atomic_load_n(&r->ctl->read, __ATOMIC_ACQUIRE);
+      } while (((rd - wr - 1) & r->mask) < EP_RING_RESERVE);
+    }
+
+    pg_next(e, &flow, &size);
+    len = e->sizes[size].frame_len;
+    rec = (struct pktgen_pkt *)(r->data + wr);
+    sum = pg_lay(e, rec, flow, len);
+    memset((char *)rec + sizeof(struct pktgen_pkt), 0,
+        PKTDEV_HDR_LEN + len - sizeof(struct pktgen_pkt));
+    pg_stamp(e, rec, sum, e->sizes[size].step);
+
+    wr = (wr + PKTDEV_HDR_LEN + len + EP_RING_ALIGN - 1) & ~(EP_RING_ALIGN - 1);
+    if (wr > r->mask)
+      wr = 0;
   }
+
+  // publish the batch
+  __atomic_store_n(&r->ctl->write, wr, __ATOMIC_RELEASE);
 }
 
 //#define mbps 1000
 //#define step (int)(84 * (1000 / (float)mbps))
-// ./pktgen_stdout -s <frame_len> -n <npkt> -m <nloop>
+// ./pktgen_stdout -s <frame_len> -n <npkt> -m <nloop> [-d <dev>]
 // ex(595 * 25010 = 14.88Mpps): ./pktgen_stdout -s 60 -n 595 -m 25010
+// with -d, records are written into the mmap()ed TX ring of <dev>
+// instead of stdout. with -v, each record goes out as a header and a
+// payload iovec of one writev() per batch.
+//
+// traffic mix:
+//   -i <len[:weight],...|imix>  frame sizes interleaved by weight
+//                               (imix: 60:7,590:4,1514:1) instead of -s
+//   -sip, -dip <a.b.c.d[-e.f.g.h]>, -sport, -dport <port[-port]>
+//                               one flow per combination, round robin
 int main(int argc, char **argv)
 {
+  static struct pg_engine eng;
+  struct ep_txring ring;
+  const char *dev = NULL;
+  const char *sizes = NULL;
   char *pack = NULL;
+  struct pktgen_pkt *hdrs = NULL;
+  struct pg_slot *slots = NULL;
+  struct iovec *iov = NULL;
+  bool vec = false;
   const char *ptr = NULL;
-  struct pktgen_pkt *pkt = NULL;
-  int ret = 0, i, pktlen, packlen, cnt, nleft;
-  unsigned int step = 84;
+  char size_buf[16];
+  int ret = 0, i, packlen, cnt, nleft;
 
   unsigned short frame_len = 60;
   unsigned int npkt = 5;
   unsigned int nloop = 10;
   unsigned int mbps = 1000;
+  uint32_t sip[2], dip[2], sport[2] = { UDP_SRC_PORT, UDP_SRC_PORT },
+    dport[2] = { UDP_DST_PORT, UDP_DST_PORT };
+
+  parse_ip_range(IP4_SRC_IP, &sip[0], &sip[1]);
+  parse_ip_range(IP4_DST_IP, &dip[0], &dip[1]);
 
   for (i = 1; i < argc; ++i) {
     if (0 == strcmp(argv[i], "-s")) {
@@ -239,14 +687,33 @@ int main(int argc, char **argv)
     } else if (0 == strcmp(argv[i], "-t")) {
       if (++i == argc) perror("-t");
       mbps = atoi(argv[i]);
+    } else if (0 == strcmp(argv[i], "-d")) {
+      if (++i == argc) perror("-d");
+      dev = argv[i];
+    } else if (0 == strcmp(argv[i], "-v")) {
+      vec = true;
+    } else if (0 == strcmp(argv[i], "-i")) {
+      if (++i == argc) perror("-i");
+      sizes = argv[i];
+    } else if (0 == strcmp(argv[i], "-sip") || 0 == strcmp(argv[i], "-dip")) {
+      if (++i == argc) perror(argv[i - 1]);
+      if (parse_ip_range(argv[i], argv[i - 1][1] == 's' ? &sip[0] : &dip[0],
+            argv[i - 1][1] == 's' ? &sip[1] : &dip[1]) < 0) {
+        fprintf(stderr, "%s error: %s\n", argv[i - 1], argv[i]);
+        return -1;
+      }
+    } else if (0 == strcmp(argv[i], "-sport") || 0 == strcmp(argv[i], "-dport")) {
+      if (++i == argc) perror(argv[i - 1]);
+      if (parse_port_range(argv[i], argv[i - 1][1] == 's' ? &sport[0] : &dport[0],
+            argv[i - 1][1] == 's' ? &sport[1] : &dport[1]) < 0) {
+        fprintf(stderr, "%s error: %s\n", argv[i - 1], argv[i]);
+        return -1;
+      }
     }
   }
 
-  step = (unsigned int)(84 * (1000 / (float)mbps));
-  fprintf(stderr, "step=%d\n", step);
-
-  if (frame_len < 60 || frame_len > 9014) {
-    fprintf(stderr, "frame size error: %d\n", frame_len);
+  if (mbps < 1) {
+    fprintf(stderr, "mbps error: %d\n", (int)mbps);
     ret = -1;
     goto out;
   }
@@ -261,26 +728,60 @@ int main(int argc, char **argv)
     goto out;
   }
 
-  pkt = malloc(sizeof(struct pktgen_pkt));
-  set_pdhdr(pkt, frame_len);
-  set_ethhdr(pkt);
-  set_ip4hdr(pkt, frame_len);
-  set_udphdr(pkt, frame_len);
-  set_pghdr(pkt);
+  if (sizes == NULL) {
+    snprintf(size_buf, sizeof(size_buf), "%d", (int)frame_len);
+    sizes = size_buf;
+  }
+  if (pg_sizes_init(&eng, sizes, mbps) < 0 ||
+      pg_flows_init(&eng, sip, dip, sport, dport) < 0) {
+    ret = -1;
+    goto out;
+  }
+  eng.reset = true;
+  fprintf(stderr, "step=%d flows=%d sizes=%d\n",
+      eng.sizes[0].step, eng.nflow, eng.nsize);
+
+  if (dev) {
+    if (txring_open(&ring, dev) < 0) {
+      ret = -1;
+      goto out;
+    }
+    for (i = 0; i < nloop; i++)
+      build_ring(&eng, &ring, npkt);
+    txring_close(&ring);
+    goto out;
+  }
+
+  slots = calloc(npkt, sizeof(struct pg_slot));
+
+  if (vec) {
+    hdrs = malloc(sizeof(struct pktgen_pkt) * npkt);
+    iov = malloc(sizeof(struct iovec) * npkt * 2);
+    pack = calloc((size_t)(PKTDEV_HDR_LEN + eng.max_len), sizeof(char));
+    for (i = 0; i < nloop; i++) {
+      build_iov(&eng, hdrs, slots, iov, pack, npkt);
+      if (writev_all(1, iov, npkt * 2) < 0) {
+        ret = -1;
+        goto out;
+      }
+    }
+    goto out;
+  }
 
-  pktlen = PKTDEV_HDR_LEN + frame_len;
-  pack = calloc((size_t)(pktlen * npkt), sizeof(char));
+  pack = calloc((size_t)(PKTDEV_HDR_LEN + eng.max_len) * npkt, sizeof(char));
 
   // nloop
-  packlen = pktlen * npkt;
   for (i = 0; i < nloop; i++) {
+    packlen = build_pack(&eng, pack, slots, npkt);
     nleft = packlen;
     ptr = (char *)pack;
-    build_pack(pack, pkt, npkt, pktlen, step);
     while (nleft > 0) {
       if ((cnt = write(1, ptr, nleft)) <= 0) {
-          // :todo (check errno)
-          ;
+        if (cnt < 0 && (errno == EINTR || errno == EAGAIN))
+          continue;
+        perror("write");
+        ret = -1;
+        goto out;
       }
       nleft -= cnt;
       ptr += cnt;
@@ -291,9 +792,17 @@ out:
   if (pack)
     free(pack);
 
-  if (pkt)
-    free(pkt);
+  if (hdrs)
+    free(hdrs);
+
+  if (iov)
+    free(iov);
+
+  if (slots)
+    free(slots);
+
+  if (eng.flows)
+    free(eng.flows);
 
   return ret;
 }
-
@@ -4,27 +4,70 @@
 #undef pr_fmt
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#ifdef __KERNEL__
 #include <linux/semaphore.h>
 #include <linux/kthread.h>
 #include <linux/pci.h>
+#include <linux/miscdevice.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/dma-mapping.h>
+#include <linux/cache.h>
+#include <linux/version.h>
+#ifdef __x86_64__
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
+#else
+#include "bench/ep_shim.h"    // userspace build of the TX datapath
+#endif
+#include "ethpipe_uapi.h"
+#include "ethpipe_procfs.h"
 
 #define VERSION  "0.4.0"
 #define DRV_NAME "ethpipe"
 
 #define EP_MAGIC           0x3776
+#define EP_PAD_MAGIC       0x3777   // skipped record in txq
 #define EP_HDR_SIZE        12       // magic:2 + frame_len:2 + ts:8
 #define EP_HWHDR_SIZE      14       // frame_len:2 + hash:4 + ts:8
 #define MAX_PKT_SIZE       9014
 #define MIN_PKT_SIZE       40
 #define RING_ALMOST_FULL   (MAX_PKT_SIZE*2)
 #define XMIT_BUDGET        0x3F
+#define EP_BATCH_MAX       256      // max frames per NIC window reservation
+#define EP_WC_LINE         64       // write-combining buffer of the TX window
+#define EP_WC_SIMD_MIN     256      // mean frame size worth an fpu save
+#define EP_MAX_TXQ         EP_NR_TXQ_MAX
 
 /* NIC parameters */
 #define TX0_WRITE_ADDR          0x30
 #define TX0_READ_ADDR           0x34
 #define NUM_TX_TIMESTAMP_REG    2
+
+/* pd_time (le): val:48, resv2:8, resv:4, reg:3, reset:1 */
+#define EP_TS_VAL_MASK          ((1ULL << 48) - 1)
+#define EP_TS_REG_SHIFT         60
+#define EP_TS_REG_MASK          0x7
+#define EP_TS_RESET             (1ULL << 63)
+#define EP_TS_TICK_NS           8        // unit of the timestamp value
 #define DMA_BUF_MAX             (1024*1024)
 
+/*
+ * RX: the NIC DMAs received frames (ep_hw_hdr + frame, 2-byte aligned)
+ * into a host ring of DMA_BUF_MAX bytes and advances RX0_WRITE_ADDR.
+ * The driver returns the space by writing RX0_READ_ADDR.
+ */
+#define RX0_DMA_ADDR            0x10
+#define RX0_DMA_LEN             0x14
+#define RX0_WRITE_ADDR          0x38
+#define RX0_READ_ADDR           0x3C
+#define RECV_BUDGET             0x3F
+
 
 #define func_enter() pr_debug("entering %s\n", __func__);
 
@@ -38,17 +81,46 @@ printk("write=%p\n", X->write);
 
 
 struct ep_thread {
-	unsigned int cpu;         /* cpu id that the thread is runnig */
+	int cpu;                  /* cpu id that the thread is bound to, or -1 */
 	struct task_struct *tsk;  /* xmit kthread */
 };
 
+/*
+ * Ring memory: physically contiguous pages on the NIC's NUMA node when
+ * they can be had, so the kernel walks it through the huge page
+ * mappings of the direct map, else vmalloc() on that node.
+ */
+struct ep_mem {
+	void *virt;
+	size_t size;
+	bool contig;              /* alloc_pages_exact(), else vmalloc() */
+};
+
+/*
+ * Ring buffer of EP records. A record never wraps: it may run into the
+ * slack behind end, and the next one starts over at start.
+ *
+ * Producer and consumer state live on separate cache lines. Each side
+ * keeps a cached copy of the other side's index and publishes its own
+ * with a release store. Single producer: ring_almost_full() and
+ * ring_write_next_aligned(). Multiple producers: ring_reserve() and
+ * ring_commit().
+ */
 struct ep_ring {
 	uint32_t size;            /* malloc size of ring */
 	uint8_t *start;           /* start address */
 	uint8_t *end;             /* end address */
 	uint32_t mask;            /* (size - 1) of ring */
-	volatile uint8_t *read;   /* next position to be read */
-	volatile uint8_t *write;  /* next position to be written */
+	struct ep_mem mem;        /* backing memory of ethpipe_ring_alloc() */
+
+	/* producer */
+	uint8_t *write ____cacheline_aligned_in_smp;  /* end of published records */
+	uint8_t *reserve;         /* next position to be written */
+	uint8_t *read_cache;      /* producer's copy of read */
+
+	/* consumer */
+	uint8_t *read ____cacheline_aligned_in_smp;   /* next position to be read */
+	uint8_t *write_cache;     /* consumer's copy of write */
 };
 
 /*
@@ -62,11 +134,11 @@ struct ep_timestamp_hdr {
 };
 */
 
-struct ep_hw_pkt {
+/* header in front of each frame in the NIC TX window */
+struct ep_hw_hdr {
 	uint16_t len;       /* frame length */
 	uint64_t ts;        /* timestamp */
 	uint32_t hash;      /* unused. reserved */
-	uint8_t body[1];    /* ethnet frame data */
 } __attribute__((__packed__));
 
 struct mmio {
@@ -89,32 +161,135 @@ struct ecp3versa {
 		uint32_t size;
 		uint32_t mask;
 	} tx;
+	struct rx {
+		volatile uint32_t *write;  /* advanced by the NIC */
+		volatile uint32_t *read;   /* advanced by the RX kthread */
+		uint8_t *virt;             /* DMA ring */
+		dma_addr_t phys;
+		uint32_t size;
+		uint32_t mask;
+	} rx;
+};
+
+/* pending frames not yet committed to the NIC */
+struct ep_doorbell {
+	uint32_t bytes;           /* pending bytes */
+	uint32_t pkts;            /* pending frames */
+	u64 since;                /* local_clock() of the oldest pending frame */
+	s64 deq;                  /* dequeue time of the oldest pending frame,
+	                             0 without lat_hist */
+};
+
+/* a TX queue's reservation in the NIC TX window */
+struct ep_hwresv {
+	bool busy;                /* reserved, not yet committed */
+	bool done;                /* frames are copied into the window */
+	uint32_t seq;             /* reservation order */
+	uint32_t end;             /* window offset following the frames */
+	uint32_t bytes;
+	uint32_t pkts;
+	s64 deq;                  /* dequeue time, 0 without lat_hist */
+};
+
+/*
+ * The NIC TX window is shared by all TX queues. A queue reserves a
+ * range under the lock, copies its frames without the lock, and then
+ * commits. Reservations are committed to the NIC in reservation order.
+ */
+struct ep_txarb {
+	spinlock_t lock;
+	uint32_t hw_read;         /* last NIC read pointer read over pcie */
+	uint32_t hw_write;        /* tail of the reserved ranges */
+	uint32_t hw_commit;       /* tail of the committed ranges */
+	uint32_t seq;             /* next reservation sequence */
+	uint32_t commit_seq;      /* next reservation to commit */
+	struct ep_doorbell db;    /* committed, doorbell not yet written */
+
+	/* lat_hist: the NIC has not yet read past probe since probe_ts */
+	uint32_t probe;
+	s64 probe_ts;             /* 0 when no probe is outstanding */
+};
+
+/*
+ * A TX context: the submission ring of one open() of a TX queue.
+ * The queue's kthread serves its contexts by deficit round robin.
+ */
+struct ep_ctx {
+	struct list_head list;    /* on q->ctx_list */
+	struct ep_txq *q;         /* TX queue the context was opened on */
+
+	struct ep_ring txq;       /* tx ring buffer */
+
+	/* mmap()-able TX ring: control page followed by txq */
+	struct ep_mem txq_mem;
+	struct ep_ring_ctl *txctl;
+	atomic_t txq_mapped;      /* number of vmas mapping txq */
+
+	/* writers and pollers waiting for room in txq */
+	wait_queue_head_t write_q;
+
+	/* write() is a byte stream: a record cut by the end of one
+	 * write() is kept here until the next one completes it */
+	struct mutex write_lock;  /* one write() at a time */
+	uint8_t *part;            /* EP_HDR_SIZE + MAX_PKT_SIZE bytes */
+	size_t part_len;
+
+	int deficit;              /* DRR credit (bytes) */
+
+	/* software scheduled transmit (tx_sched) */
+	s64 ts_base[NUM_TX_TIMESTAMP_REG];  /* ktime (ns) of timestamp 0 */
+	bool ts_valid[NUM_TX_TIMESTAMP_REG];
+	s64 ts_next;              /* deadline of the held frame, or 0 */
+
+	/* lat_hist: one record of write() waiting for the kthread */
+	spinlock_t lat_lock;
+	uint8_t *lat_rec;
+	s64 lat_ts;
+
+	u64 tx_counter;           /* tx packet counter */
+	uint32_t tx_avg_len;      /* moving average of sent frame length */
+};
+
+struct ep_txq {
+	int idx;
+	char name[16];
+	struct miscdevice misc;   /* /dev/ethpipe/0, /dev/ethpipe/0-txN */
+
+	/* TX contexts, one per open() */
+	spinlock_t ctx_lock;
+	struct list_head ctx_list;
+	bool backlog;             /* a context has frames ready to send */
+	s64 ts_next;              /* earliest deadline of held frames, or 0 */
+
+	struct ep_thread txth;    /* tx thread for sending packets */
+	bool sleeping;            /* txth is asleep, writers wake it */
+	struct ep_hwresv resv;
+
+	u64 tx_counter;           /* tx packet counter */
 };
 
 struct ep_dev {
+	int node;              /* NUMA node of the NIC, or NUMA_NO_NODE */
+
 	int txq_size;          /* TX ring size */
 	int rxq_size;          /* RX ring size */
-	int wrq_size;          /* write ring size */
 	int rdq_size;          /* read ring size */
 
-	struct ep_ring txq;    /* tx ring buffer */
+	int nr_txq;            /* number of TX queues */
+	struct ep_txq txqs[EP_MAX_TXQ];
+	struct ep_txarb arb;   /* NIC TX window arbiter */
+
 	struct ep_ring rxq;    /* rx ring buffer */
-	struct ep_ring wrq;    /* to store copy_from_user() data */
 	struct ep_ring rdq;    /* rx ring buffer from dev_add_pack */
 
-	struct ep_thread txth; /* tx thread for sending packets */
-//	struct ep_thread rxth; /* rx thread for recv packets */
+	struct ep_thread rxth; /* rx thread for recv packets */
 
-	uint32_t tx_counter;   /* tx packet counter */
-	uint32_t rx_counter;   /* rx packet counter */
+	u64 rx_counter;        /* rx packet counter */
 
 	/* RX wait queue */
 	wait_queue_head_t read_q;
 	struct semaphore pktdev_sem;
 
-	/* temporary buffer for build packet */
-	struct ep_hw_pkt *hw_pkt;
-
 	/* NIC */
 	struct ecp3versa nic;
 };
@@ -122,32 +297,194 @@ struct ep_dev {
 /* Global variables */
 static struct ep_dev *pdev;
 
-/* Module parameters, defaults. */
-static int debug = 0;
-static int txq_size = 32;
-static int rxq_size = 32;
-static int wrq_size = 32;
-static int rdq_size = 32;
+/* Module parameters, defaults. bench/ builds without module_param() */
+static int debug __maybe_unused = 0;
+static int txq_size __maybe_unused = 32;
+static int rxq_size __maybe_unused = 32;
+static int rdq_size __maybe_unused = 32;
+static int tx_budget_min __maybe_unused = 1;
+static int tx_budget_max __maybe_unused = XMIT_BUDGET;
+static int tx_db_bytes __maybe_unused = 32 * 1024;
+static int tx_db_pkts __maybe_unused = 64;
+static int tx_db_usecs __maybe_unused = 20;
+static int tx_quantum __maybe_unused = 16 * 1024;
+static int tx_sched __maybe_unused = 0;
+static int tx_sched_spin_ns __maybe_unused = 20000;
+static int busy_poll __maybe_unused = 0;
+static int tx_spin_us __maybe_unused = 50;
+static int rx_spin_us __maybe_unused = 50;
+static int rx_poll_us __maybe_unused = 100;
+static int tx_wc_simd __maybe_unused = 1;
+static int lat_hist __maybe_unused = 0;
+static int nr_txq __maybe_unused = 1;
+static int tx_cpu[EP_MAX_TXQ] __maybe_unused = { [0 ... EP_MAX_TXQ - 1] = -1 };
+static int nr_tx_cpu __maybe_unused;
+static int rx_cpu __maybe_unused = -1;
 
 
+/*
+ * Observers (poll, other queues): a snapshot of both indices
+ */
 static inline uint32_t ring_count(const struct ep_ring *r)
 {
-	return ((r->write - r->read) & r->mask);
+	return ((ACCESS_ONCE(r->write) - ACCESS_ONCE(r->read)) & r->mask);
 }
 
 static inline uint32_t ring_free_count(const struct ep_ring *r)
 {
-	return ((r->read - r->write - 1) & r->mask);
+	return ((ACCESS_ONCE(r->read) - ACCESS_ONCE(r->write) - 1) & r->mask);
 }
 
 static inline bool ring_empty(const struct ep_ring *r)
 {
-	return !!(r->read == r->write);
+	return !!(ACCESS_ONCE(r->read) == ACCESS_ONCE(r->write));
+}
+
+static inline uint8_t *ring_wrap(const struct ep_ring *r, uint8_t *p,
+		uint32_t size)
+{
+	p += ALIGN(size, 4);
+	if (p > r->end) {
+		p = r->start;
+	}
+	return p;
+}
+
+/*
+ * Producer side. The free space is computed against read_cache and
+ * the consumer's line is only loaded when the cached view runs short.
+ */
+static inline bool ring_almost_full(struct ep_ring *r)
+{
+	if (((r->read_cache - r->reserve - 1) & r->mask) >= RING_ALMOST_FULL)
+		return false;
+
+	r->read_cache = smp_load_acquire(&r->read);
+	return !!(((r->read_cache - r->reserve - 1) & r->mask) < RING_ALMOST_FULL);
+}
+
+/* single producer: publish the record at r->write */
+static inline void ring_write_next_aligned(struct ep_ring *r, uint32_t size)
+{
+	uint8_t *next = ring_wrap(r, r->write, size);
+
+	r->reserve = next;
+	smp_store_release(&r->write, next);
+}
+
+/*
+ * multiple producers: claim size bytes at the reserve head.
+ * returns NULL when the ring is almost full.
+ */
+static inline uint8_t *ring_reserve(struct ep_ring *r, uint32_t size)
+{
+	uint8_t *head;
+
+	do {
+		head = ACCESS_ONCE(r->reserve);
+		if (((r->read_cache - head - 1) & r->mask) < RING_ALMOST_FULL) {
+			r->read_cache = smp_load_acquire(&r->read);
+			if (((r->read_cache - head - 1) & r->mask) < RING_ALMOST_FULL)
+				return NULL;
+		}
+	} while (cmpxchg(&r->reserve, head, ring_wrap(r, head, size)) != head);
+
+	return head;
+}
+
+/*
+ * multiple producers: publish a reserved record. records are published
+ * in reservation order, so wait for the earlier producers first.
+ */
+static inline void ring_commit(struct ep_ring *r, uint8_t *rec, uint32_t size)
+{
+	while (ACCESS_ONCE(r->write) != rec)
+		cond_resched();
+
+	smp_store_release(&r->write, ring_wrap(r, rec, size));
+}
+
+/*
+ * Consumer side. ring_cons_sync() refreshes write_cache once per batch,
+ * records up to write_cache are complete.
+ */
+static inline uint32_t ring_cons_sync(struct ep_ring *r)
+{
+	r->write_cache = smp_load_acquire(&r->write);
+	return ((r->write_cache - r->read) & r->mask);
+}
+
+static inline uint32_t ring_cons_count(const struct ep_ring *r)
+{
+	return ((r->write_cache - r->read) & r->mask);
+}
+
+static inline bool ring_cons_empty(const struct ep_ring *r)
+{
+	return !!(r->read == r->write_cache);
+}
+
+static inline void ring_read_next_aligned(struct ep_ring *r, uint32_t size)
+{
+	smp_store_release(&r->read, ring_wrap(r, r->read, size));
+}
+
+/* drop every record up to write_cache */
+static inline void ring_cons_drop(struct ep_ring *r)
+{
+	smp_store_release(&r->read, r->write_cache);
+}
+
+static inline void ring_reset(struct ep_ring *r)
+{
+	r->write = r->reserve = r->read_cache = r->start;
+	r->read = r->write_cache = r->start;
+}
+
+/*
+ * EP record accessors: magic:2 + frame_len:2 + ts:8 + frame
+ */
+static inline uint16_t ep_rec_magic(const uint8_t *rec)
+{
+	return *(uint16_t *)&rec[0];
+}
+
+static inline uint16_t ep_rec_len(const uint8_t *rec)
+{
+	return *(uint16_t *)&rec[2];
+}
+
+static inline uint8_t *ring_next_rec(const struct ep_ring *r,
+		uint8_t *rec, uint32_t size)
+{
+	return ring_wrap(r, rec, size);
+}
+
+/*
+ * ring_rec_fits: a record of size bytes at rec lies within what the
+ * producer published (write_cache). frame_len must already be bounded
+ * by MAX_PKT_SIZE, so that the record stays inside ring + slack.
+ */
+static inline bool ring_rec_fits(const struct ep_ring *r, uint8_t *rec,
+		uint32_t size)
+{
+	uint8_t *next = ring_next_rec(r, rec, size);
+
+	return ((uint32_t)(next - rec) & r->mask) <=
+		((uint32_t)(r->write_cache - rec) & r->mask);
+}
+
+static inline void ep_rec_set_hdr(uint8_t *rec, uint16_t frame_len, uint64_t ts)
+{
+	*(uint16_t *)&rec[0] = EP_MAGIC;
+	*(uint16_t *)&rec[2] = frame_len;
+	*(uint64_t *)&rec[4] = ts;
 }
 
-static inline bool ring_almost_full(const struct ep_ring *r)
+/* a reserved record that could not be filled. the TX kthread skips it */
+static inline void ep_rec_set_pad(uint8_t *rec)
 {
-	return !!(ring_free_count(r) < RING_ALMOST_FULL);
+	*(uint16_t *)&rec[0] = EP_PAD_MAGIC;
 }
 
 static inline uint16_t ring_next_magic(struct ep_ring *r)
@@ -165,53 +502,77 @@ static inline uint64_t ring_next_timestamp(struct ep_ring *r)
 	return *(uint64_t *)&r->read[4];
 }
 
-static inline uint8_t ring_next_ts_reset(struct ep_ring *r)
+static inline uint64_t ep_rec_timestamp(const uint8_t *rec)
+{
+	return *(uint64_t *)&rec[4];
+}
+
+static inline uint64_t ep_ts_val(uint64_t ts)
+{
+	return ts & EP_TS_VAL_MASK;
+}
+
+static inline uint8_t ep_ts_reg(uint64_t ts)
+{
+	return (ts >> EP_TS_REG_SHIFT) & EP_TS_REG_MASK;
+}
+
+static inline bool ep_ts_reset(uint64_t ts)
 {
-	return r->read[4];
+	return !!(ts & EP_TS_RESET);
+}
+
+static inline bool ring_next_ts_reset(struct ep_ring *r)
+{
+	return ep_ts_reset(ring_next_timestamp(r));
 }
 
 static inline uint8_t ring_next_ts_reg(struct ep_ring *r)
 {
-	return r->read[5];
+	return ep_ts_reg(ring_next_timestamp(r));
 }
 
-static inline void ring_write_next(struct ep_ring *r, uint32_t size)
+/*
+ * Shared control page of a mmap()ed ring (see ethpipe_uapi.h)
+ */
+static inline void ring_ctl_pull_write(struct ep_ring *r,
+		const struct ep_ring_ctl *ctl)
 {
-	r->write += size;
-	if (r->write > r->end) {
-		r->write = r->start;
-	}
+	uint32_t off = ACCESS_ONCE(ctl->write) & r->mask & ~(EP_RING_ALIGN - 1);
+
+	/* order the index load before loading the records behind it */
+	smp_rmb();
+
+	/* the kthread stands in for the userland producer */
+	r->reserve = r->start + off;
+	smp_store_release(&r->write, r->start + off);
 }
 
-static inline void ring_read_next(struct ep_ring *r, uint32_t size)
+static inline void ring_ctl_push_write(const struct ep_ring *r,
+		struct ep_ring_ctl *ctl)
 {
-	r->read += size;
-	if (r->read > r->end) {
-		r->read = r->start;
-	}
+	smp_wmb();
+	ACCESS_ONCE(ctl->write) = (uint32_t)(ACCESS_ONCE(r->write) - r->start);
 }
 
-static inline void ring_write_next_aligned(struct ep_ring *r, uint32_t size)
+static inline void ring_ctl_push_read(const struct ep_ring *r,
+		struct ep_ring_ctl *ctl)
 {
-	r->write += ALIGN(size, 4);
-	if (r->write > r->end) {
-		r->write = r->start;
-	}
+	/* records must be consumed before the producer may reuse them */
+	smp_mb();
+	ACCESS_ONCE(ctl->read) = (uint32_t)(r->read - r->start);
 }
 
-static inline void ring_read_next_aligned(struct ep_ring *r, uint32_t size)
+static inline uint32_t hwtx_frame_size(uint32_t size)
 {
-	r->read += ALIGN(size, 4);
-	if (r->read > r->end) {
-		r->read = r->start;
-	}
+	return ALIGN(EP_HWHDR_SIZE + size, 2);
 }
 
 static inline uint32_t hwtx_xmit_next(uint32_t hw_write, uint32_t size)
 {
 	struct ecp3versa *nic = &pdev->nic;
 
-	hw_write += ALIGN(EP_HWHDR_SIZE + size, 2);
+	hw_write += hwtx_frame_size(size);
 	hw_write &= nic->tx.mask;
 
 	return hw_write;
@@ -227,7 +588,7 @@ static inline void set_nic_txptr(uint32_t *p, uint32_t addr)
 	*p = addr >> 1;
 }
 
-static inline void dump_nic_info(struct ep_hw_pkt *hw_pkt)
+static inline void dump_nic_info(struct ep_hw_hdr *hw_hdr, const uint8_t *body)
 {
 	struct ecp3versa *nic = &pdev->nic;
 
@@ -237,17 +598,17 @@ static inline void dump_nic_info(struct ep_hw_pkt *hw_pkt)
 	pr_info("nic->tx.size: %X\n", (unsigned int)nic->tx.size);
 
 	pr_info("----packet\n");
-	pr_info("hw_pkt->len: %X\n", (uint32_t)hw_pkt->len);
-	pr_info("hw_pkt->hash: %X\n", (uint32_t)hw_pkt->hash);
-	pr_info("hw_pkt->ts: %X\n", (uint32_t)hw_pkt->ts);
-	pr_info("hw_pkt->body0: %02X%02X%02X%02X%02X%02X\n",
-		hw_pkt->body[ 0], hw_pkt->body[ 1], hw_pkt->body[ 2],
-		hw_pkt->body[ 3], hw_pkt->body[ 4], hw_pkt->body[ 5]);
-	pr_info("hw_pkt->body1: %02X%02X%02X%02X%02X%02X\n",
-		hw_pkt->body[ 6], hw_pkt->body[ 7], hw_pkt->body[ 8],
-		hw_pkt->body[ 9], hw_pkt->body[10], hw_pkt->body[11]);
-	pr_info("hw_pkt->body2: %02X%02X\n",
-		hw_pkt->body[12], hw_pkt->body[13]);
+	pr_info("hw_hdr->len: %X\n", (uint32_t)hw_hdr->len);
+	pr_info("hw_hdr->hash: %X\n", (uint32_t)hw_hdr->hash);
+	pr_info("hw_hdr->ts: %X\n", (uint32_t)hw_hdr->ts);
+	pr_info("body0: %02X%02X%02X%02X%02X%02X\n",
+		body[ 0], body[ 1], body[ 2],
+		body[ 3], body[ 4], body[ 5]);
+	pr_info("body1: %02X%02X%02X%02X%02X%02X\n",
+		body[ 6], body[ 7], body[ 8],
+		body[ 9], body[10], body[11]);
+	pr_info("body2: %02X%02X\n",
+		body[12], body[13]);
 	pr_info("----packet\n");
 }
 
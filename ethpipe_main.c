@@ -10,35 +10,45 @@
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <linux/smp.h>
 #include <linux/pci.h>
+#include <linux/capability.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
 #include "ethpipe.h"
+#include "ethpipe_tx.h"
 
-#define EP_XMIT_OK    0x10
-#define EP_XMIT_BUSY  0x11
-#define EP_XMIT_ERR   0x12
+/* keep last: define_trace.h re-reads ethpipe_trace.h from here */
+#define CREATE_TRACE_POINTS
+#include "ethpipe_trace.h"
 
 static int ethpipe_open(struct inode *inode, struct file *filp);
 static int ethpipe_release(struct inode *inode, struct file *filp);
 static ssize_t ethpipe_read(struct file *filp, char __user *buf,
 		size_t count, loff_t *ppos);
-static ssize_t ethpipe_write(struct file *filp, const char __user *buf,
-		size_t count, loff_t *ppos);
+static ssize_t ethpipe_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static unsigned int ethpipe_poll( struct file* filp, poll_table* wait );
+static int ethpipe_mmap(struct file *filp, struct vm_area_struct *vma);
 static long ethpipe_ioctl(struct file *filp,
 		unsigned int cmd, unsigned long arg);
 
-static inline void ethpipe_send(void);
-static inline int ethpipe_xmit(uint32_t hw_write,
-		uint32_t hw_read, int len);
-static int ethpipe_tx_kthread(void *unused);
-static inline void ethpipe_recv(void);
+static struct page *ethpipe_mem_page(const struct ep_mem *m, void *p);
+static struct ep_ctx *ethpipe_ctx_alloc(struct ep_txq *q);
+static void ethpipe_ctx_free(struct ep_ctx *ctx);
+static int ethpipe_tx_kthread(void *data);
+static int ethpipe_tx_start(void);
+static void ethpipe_tx_stop(void);
+static inline int ethpipe_recv(void);
+static int ethpipe_rx_kthread(void *unused);
 static int ethpipe_pdev_init(void);
 static void ethpipe_pdev_free(void);
 
@@ -50,19 +60,16 @@ static void ethpipe_nic_remove(struct pci_dev *pcidev);
 static struct file_operations ethpipe_fops = {
 	.owner = THIS_MODULE,
 	.read = ethpipe_read,
-	.write = ethpipe_write,
+	.write_iter = ethpipe_write_iter,
+	.splice_write = iter_file_splice_write,
 	.poll = ethpipe_poll,
+	.mmap = ethpipe_mmap,
+	.unlocked_ioctl = ethpipe_ioctl,
 	.compat_ioctl = ethpipe_ioctl,
 	.open = ethpipe_open,
 	.release = ethpipe_release,
 };
 
-static struct miscdevice ethpipe_dev = {
-	.minor = MISC_DYNAMIC_MINOR,
-	.name = DRV_NAME,
-	.fops = &ethpipe_fops,
-};
-
 DEFINE_PCI_DEVICE_TABLE(ethpipe_pci_tbl) = {
 	{0x3776, 0x8001, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
 	{0,}
@@ -84,8 +91,31 @@ struct pci_driver ethpipe_pci_driver = {
  */
 static int ethpipe_open(struct inode *inode, struct file *filp)
 {
+	struct ep_txq *q;
+	struct ep_ctx *ctx;
+
 	func_enter();
 
+	// misc_open() hands us the miscdevice of the opened TX queue
+	q = container_of(filp->private_data, struct ep_txq, misc);
+
+	// read-only and ioctl-only opens have nothing to send: no ring
+	if (!(filp->f_mode & FMODE_WRITE)) {
+		filp->private_data = NULL;
+		return 0;
+	}
+
+	// each open for writing gets its own TX context on that queue
+	ctx = ethpipe_ctx_alloc(q);
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	spin_lock(&q->ctx_lock);
+	list_add_tail(&ctx->list, &q->ctx_list);
+	spin_unlock(&q->ctx_lock);
+
+	filp->private_data = ctx;
+
 	return 0;
 }
 
@@ -94,304 +124,842 @@ static int ethpipe_open(struct inode *inode, struct file *filp)
  */
 static int ethpipe_release(struct inode *inode, struct file *filp)
 {
+	struct ep_ctx *ctx = filp->private_data;
+	struct ep_txq *q;
+
 	func_enter();
 
+	if (ctx == NULL)
+		return 0;
+	q = ctx->q;
+
+	// give the kthread a moment to send what is still queued
+	wait_event_interruptible_timeout(ctx->write_q,
+			ethpipe_txq_queued(ctx) == 0, HZ);
+
+	spin_lock(&q->ctx_lock);
+	list_del(&ctx->list);
+	spin_unlock(&q->ctx_lock);
+
+	ethpipe_ctx_free(ctx);
+
 	return 0;
 }
 
 /*
- * ethpipe_recv
+ * recv_copy: copy from the RX DMA ring at rd, wrapping at the ring end.
+ * returns the ring offset following the copied data.
+ */
+static inline uint32_t recv_copy(void *dst, uint32_t rd, uint32_t len)
+{
+	struct rx *rx = &pdev->nic.rx;
+	uint32_t tmp;
+
+	if ((rd + len) < rx->size) {
+		memcpy(dst, rx->virt + rd, len);
+		return rd + len;
+	}
+
+	tmp = rx->size - rd;
+	memcpy(dst, rx->virt + rd, tmp);
+	memcpy((uint8_t *)dst + tmp, rx->virt, len - tmp);
+
+	return len - tmp;
+}
+
+/*
+ * ethpipe_recv: move received frames from the RX DMA ring into rxq as
+ * EP records (magic, frame_len, timestamp, frame).
+ * returns the number of received frames.
  */
-static inline void ethpipe_recv(void)
+static inline int ethpipe_recv(void)
 {
+	struct rx *rx = &pdev->nic.rx;
+	struct ep_ring *rxq = &pdev->rxq;
+	struct ep_hw_hdr hdr;
+	uint32_t hw_write, hw_read, hw_read_start;
+	uint16_t frame_len;
+	int limit = RECV_BUDGET, npkts = 0;
+	u64 bytes = 0;
+
 	func_enter();
 
-	return;
+	// read hwrx write address via pcie pio read
+	hw_write = read_nic_txptr((uint32_t *)rx->write);
+	hw_read = read_nic_txptr((uint32_t *)rx->read);
+	hw_read_start = hw_read;
+
+	while ((hw_read != hw_write) && (limit-- > 0)) {
+		if (ring_almost_full(rxq)) {
+			pr_debug("rxq is full.\n");
+			ep_stat_inc(EP_STAT_RX_FULL);
+			break;
+		}
+
+		recv_copy(&hdr, hw_read, EP_HWHDR_SIZE);
+		frame_len = be16_to_cpu(hdr.len);
+		if ((frame_len > MAX_PKT_SIZE) || (frame_len < MIN_PKT_SIZE)) {
+			pr_info("rx format error: frame_len=%X\n", (int)frame_len);
+			ep_stat_inc(EP_STAT_RX_FMT_ERR);
+			// resync with the NIC by dropping everything received
+			hw_read = hw_write;
+			break;
+		}
+
+		ep_rec_set_hdr((uint8_t *)rxq->write, frame_len, be64_to_cpu(hdr.ts));
+		recv_copy((uint8_t *)rxq->write + EP_HDR_SIZE,
+				(hw_read + EP_HWHDR_SIZE) & rx->mask, frame_len);
+
+		// publish the record to ethpipe_read()
+		ring_write_next_aligned(rxq, EP_HDR_SIZE + frame_len);
+
+		hw_read = (hw_read + hwtx_frame_size(frame_len)) & rx->mask;
+		bytes += frame_len;
+		++npkts;
+	}
+
+	// compare with the pointer read above: another uncached pio read
+	// on every idle poll costs more than it saves
+	if (hw_read != hw_read_start) {
+		// return the DMA ring space to NIC via pcie pio write
+		set_nic_txptr((uint32_t *)rx->read, hw_read);
+	}
+
+	if (npkts) {
+		pdev->rx_counter += npkts;    // incr rx_counter
+		ep_stat_add(EP_STAT_RX_PKTS, npkts);
+		ep_stat_add(EP_STAT_RX_BYTES, bytes);
+		ep_hwm_update(&ep_hwm.rxq, ring_count(rxq));
+		wake_up_interruptible(&pdev->read_q);
+	}
+
+	return npkts;
 }
 
 /*
- * ethpipe_read
+ * ethpipe_read: whole EP records from rxq, as many as fit in count.
+ * -EMSGSIZE when the next record alone does not fit: returning 0 would
+ * read as EOF.
  */
 static ssize_t ethpipe_read(struct file *filp, char __user *buf,
 			   size_t count, loff_t *ppos)
 {
+	struct ep_ring *rxq = &pdev->rxq;
+	size_t copied = 0;
+	uint16_t len;
+
 	func_enter();
 
-	ethpipe_recv();
+	if (count < EP_HDR_SIZE + MIN_PKT_SIZE)
+		return -EINVAL;
+
+	if (down_interruptible(&pdev->pktdev_sem))
+		return -ERESTARTSYS;
+
+	while (ring_cons_sync(rxq) == 0) {
+		up(&pdev->pktdev_sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(pdev->read_q, !ring_empty(rxq)))
+			return -ERESTARTSYS;
+		if (down_interruptible(&pdev->pktdev_sem))
+			return -ERESTARTSYS;
+	}
+
+	while (!ring_cons_empty(rxq)) {
+		len = EP_HDR_SIZE + ring_next_frame_len(rxq);
+		if (copied + len > count) {
+			if (copied == 0)
+				copied = -EMSGSIZE;
+			break;
+		}
 
-	return count;
+		if (copy_to_user(buf + copied, (uint8_t *)rxq->read, len)) {
+			pr_info("copy_to_user failed. count=%d\n", (int)count);
+			if (copied == 0)
+				copied = -EFAULT;
+			break;
+		}
+		copied += len;
+		ring_read_next_aligned(rxq, len);
+	}
+
+	up(&pdev->pktdev_sem);
+
+	return copied;
 }
 
 /*
- * build_ep_pkt
+ * tx_sched_wait: sleep on a hrtimer until tx_sched_spin_ns before the
+ * next deadline, for at most one tick, and spin through the rest
  */
-static inline int build_ep_pkt(struct ep_hw_pkt *pkt)
+static inline void tx_sched_wait(s64 due)
 {
-	uint16_t magic, frame_len;
-	struct ep_ring *txq = &pdev->txq;
+	ktime_t expires;
+	s64 now = ktime_to_ns(ktime_get());
+	s64 wake = due - tx_sched_spin_ns;
 
-	// check magic code
-	magic = ring_next_magic(txq);
-	if (magic != EP_MAGIC) {
-		pr_info("packet format error: magic=%X\n", (int)magic);
-		return 0;
-	}
-	// check frame length
-	frame_len = ring_next_frame_len(txq);
-	if ((frame_len > MAX_PKT_SIZE) || (frame_len < MIN_PKT_SIZE)) {
-		pr_info("packet format error: frame_len=%X\n", (int)frame_len);
-		return 0;
+	if (wake <= now) {
+		if (need_resched())
+			schedule();
+		else
+			cpu_relax();
+		return;
 	}
 
-	pkt->len = cpu_to_be16(frame_len);
-	pkt->hash = 0;
-	pkt->ts = cpu_to_be64(ring_next_timestamp(txq));
-	//pkt->ts = ring_next_timestamp(txq);
+	// other contexts may queue frames that are due earlier
+	if (wake - now > TICK_NSEC)
+		wake = now + TICK_NSEC;
 
-	memcpy(&pkt->body, (uint8_t *)(txq->read + EP_HDR_SIZE), frame_len);
+	expires = ns_to_ktime(wake);
+	set_current_state(TASK_INTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+}
 
-	return frame_len;
+/*
+ * ethpipe_part_fill: move the next bytes of from into the partial
+ * record of ctx, header first, then the frame it announces.  returns
+ * the number of bytes taken, or an error with the partial record dropped.
+ */
+static ssize_t ethpipe_part_fill(struct ep_ctx *ctx, struct iov_iter *from)
+{
+	size_t want, n, taken = 0;
+	int frame_len;
+
+	for (;;) {
+		want = EP_HDR_SIZE;
+		if (ctx->part_len >= EP_HDR_SIZE) {
+			frame_len = ep_rec_frame_len(ctx->part);
+			if (frame_len == 0) {
+				ctx->part_len = 0;
+				return -EFAULT;
+			}
+			want += frame_len;
+		}
+		n = min(want - ctx->part_len, iov_iter_count(from));
+		if (n == 0)
+			return taken;
+		if (copy_from_iter(ctx->part + ctx->part_len, n, from) != n) {
+			pr_info("copy_from_iter failed. part_len=%d\n", (int)ctx->part_len);
+			ctx->part_len = 0;
+			return -EFAULT;
+		}
+		ctx->part_len += n;
+		taken += n;
+	}
 }
 
 /*
- * hxtx_alomost_full
+ * ethpipe_part_full: the partial record of ctx is complete
  */
-static inline bool hwtx_almost_full(uint32_t wr, uint32_t rd)
+static inline bool ethpipe_part_full(const struct ep_ctx *ctx)
 {
-	return !!((rd - wr - 1) < MAX_PKT_SIZE);
+	return (ctx->part_len >= EP_HDR_SIZE) &&
+		(ctx->part_len == EP_HDR_SIZE + ep_rec_len(ctx->part));
 }
 
 /*
- * xmit
+ * ethpipe_write_iter: write(2) and writev(2).  the data is a stream of
+ * records, cut anywhere: records may span iovecs and write() calls.
  */
-static inline void xmit(uint32_t wr, struct ep_hw_pkt *pkt, int len)
+static ssize_t ethpipe_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	uint8_t *nic_virt = pdev->nic.mmio1.virt;
-	uint32_t tmp;
+	uint16_t frame_len, len;
+	uint8_t hdr[EP_HDR_SIZE];
+	uint8_t *rec;
+	struct file *filp = iocb->ki_filp;
+	struct ep_ctx *ctx = filp->private_data;
+	struct ep_ring *txq = &ctx->txq;
+	struct iov_iter rec_start;
+	size_t count = iov_iter_count(from);
+	size_t done = 0, bytes = 0;
+	ssize_t taken = 0;
+	bool whole;
+	int npkts = 0;
+	ssize_t err = 0;
+
+	func_enter();
 
-	len += EP_HWHDR_SIZE;
+	// the partial record belongs to the stream of this open file
+	if (mutex_lock_interruptible(&ctx->write_lock))
+		return -ERESTARTSYS;
 
-	if ((wr + len) < pdev->nic.tx.size) {
-		memcpy(nic_virt + wr, pkt, len);
-	} else {
-		tmp = pdev->nic.tx.size - wr;
-		//pr_info("overwriting: wr=%d, tmp=%d\n", wr, tmp);
-		memcpy(nic_virt + wr, pkt, tmp);
-		memcpy(nic_virt, ((uint8_t *)pkt + tmp), (len - tmp));
-		//dump_nic_info((struct ep_hw_pkt *)((uint8_t *)pkt + tmp));
+	// txq is owned by the userland producer while it is mapped.
+	// write_lock keeps mmap() from handing it over under us.
+	if (atomic_read(&ctx->txq_mapped)) {
+		mutex_unlock(&ctx->write_lock);
+		return -EBUSY;
 	}
+
+	// userland to txq, one record at a time
+	while (iov_iter_count(from)) {
+		rec_start = *from;
+		whole = false;
+
+		// records wholly in from go straight into txq
+		if (ctx->part_len == 0 && iov_iter_count(from) >= EP_HDR_SIZE) {
+			if (copy_from_iter(hdr, EP_HDR_SIZE, from) != EP_HDR_SIZE) {
+				pr_info("copy_from_iter failed. count=%d\n", (int)count);
+				err = -EFAULT;
+				break;
+			}
+
+			// check magic code, frame length and timestamp register
+			frame_len = ep_rec_frame_len(hdr);
+			if (frame_len == 0) {
+				err = -EFAULT;
+				break;
+			}
+			len = EP_HDR_SIZE + frame_len;
+			whole = (iov_iter_count(from) >= frame_len);
+			if (!whole)
+				*from = rec_start;
+		}
+
+		// the others are gathered in ctx->part. a record not
+		// complete yet waits for the next write()
+		if (!whole) {
+			taken = ethpipe_part_fill(ctx, from);
+			if (taken < 0) {
+				err = taken;
+				break;
+			}
+			done += taken;
+			if (!ethpipe_part_full(ctx))
+				break;
+			len = ctx->part_len;
+		}
+
+		// wait for the TX kthread to drain txq
+		while ((rec = ring_reserve(txq, len)) == NULL) {
+			ep_stat_inc(EP_STAT_WRITE_FULL);
+			ethpipe_tx_kick(ctx->q);
+			if (filp->f_flags & O_NONBLOCK) {
+				pr_debug("txq is full.\n");
+				err = -EAGAIN;
+			} else if (wait_event_interruptible(ctx->write_q, !ring_almost_full(txq))) {
+				err = -ERESTARTSYS;
+			}
+			if (err) {
+				// give back what this call added to the partial record
+				if (!whole) {
+					ctx->part_len -= taken;
+					done -= taken;
+				}
+				*from = rec_start;
+				goto out;
+			}
+		}
+
+		if (whole) {
+			memcpy(rec, hdr, EP_HDR_SIZE);
+			if (copy_from_iter(rec + EP_HDR_SIZE, frame_len, from) != frame_len) {
+				pr_info("copy_from_iter failed. count=%d\n", (int)count);
+				ep_rec_set_pad(rec);
+				ring_commit(txq, rec, len);
+				err = -EFAULT;
+				break;
+			}
+			done += len;
+		} else {
+			memcpy(rec, ctx->part, len);
+			ctx->part_len = 0;
+		}
+		// lat_hist: sample this record unless one is still queued
+		if (lat_hist && !ACCESS_ONCE(ctx->lat_rec))
+			lat_ingest_mark(ctx, rec);
+		ring_commit(txq, rec, len);
+
+		bytes += len - EP_HDR_SIZE;
+		++npkts;
+	}
+
+out:
+	mutex_unlock(&ctx->write_lock);
+	if (npkts) {
+		// the kthread may have gone to sleep on an empty ring
+		ethpipe_tx_kick(ctx->q);
+		ep_stat_add(EP_STAT_WRITE_PKTS, npkts);
+		ep_stat_add(EP_STAT_WRITE_BYTES, bytes);
+	}
+	trace_ethpipe_write(ctx->q->idx, count, done, npkts, (int)err);
+#if 0
+	pr_info("txq.wr %p, txq.rd %p, nic.wr %d, nic.rd %d\n",
+			txq->write, txq->read,
+			*pdev->nic.tx.write, *pdev->nic.tx.read);
+#endif
+	return done ? done : err;
 }
 
 /*
- * ethpipe_xmit
+ * ethpipe_poll
  */
-static inline int ethpipe_xmit(uint32_t hw_write,
-		uint32_t hw_read, int len)
+static unsigned int ethpipe_poll(struct file* filp, poll_table* wait)
 {
-	struct ep_ring *txq = &pdev->txq;
-	int ret = EP_XMIT_OK;
+	struct ep_ctx *ctx = filp->private_data;
+	unsigned int retmask = 0;
 
 	func_enter();
 
-	if (!hwtx_almost_full(hw_write, hw_read)) {
-		xmit(hw_write, pdev->hw_pkt, len);
-		ring_read_next_aligned(txq, EP_HDR_SIZE + len);
-		ret = EP_XMIT_OK;
-	} else {
-		ret = EP_XMIT_BUSY;
+	poll_wait(filp, &pdev->read_q, wait);
+	if (ctx)
+		poll_wait(filp, &ctx->write_q, wait);
+
+	if (!ring_empty(&pdev->rxq)) {
+		retmask |= (POLLIN  | POLLRDNORM);
 	}
 
-	return ret;
+	if (ctx && ethpipe_txq_writable(ctx)) {
+		retmask |= (POLLOUT | POLLWRNORM);
+	}
+
+	return retmask;
 }
 
 /*
- * ethpipe_send
+ * ethpipe_vma_open
  */
-static inline void ethpipe_send(void)
+static void ethpipe_vma_open(struct vm_area_struct *vma)
 {
-	int limit, ret, len;
-	uint32_t hw_write, hw_read;
-	struct ep_ring *txq = &pdev->txq;
+	struct ep_ctx *ctx = vma->vm_private_data;
 
-	func_enter();
+	atomic_inc(&ctx->txq_mapped);
+}
 
-	// read hwtx read and write address via pcie pio read
-	hw_write = read_nic_txptr((uint32_t *)pdev->nic.tx.write);
-	hw_read = read_nic_txptr((uint32_t *)pdev->nic.tx.read);
+/*
+ * ethpipe_vma_close
+ */
+static void ethpipe_vma_close(struct vm_area_struct *vma)
+{
+	struct ep_ctx *ctx = vma->vm_private_data;
+	struct ep_txq *q = ctx->q;
+
+	// the kthread stops pulling at the last unmap. take over what
+	// the producer published since its last pull. no write() holds
+	// write_lock here while it can fault: txq is still mapped.
+	mutex_lock(&ctx->write_lock);
+	spin_lock(&q->ctx_lock);
+	if (atomic_dec_and_test(&ctx->txq_mapped))
+		ring_ctl_pull_write(&ctx->txq, ctx->txctl);
+	spin_unlock(&q->ctx_lock);
+	mutex_unlock(&ctx->write_lock);
+}
 
-	// reset xmit budget
-	limit = XMIT_BUDGET;
+static const struct vm_operations_struct ethpipe_vm_ops = {
+	.open = ethpipe_vma_open,
+	.close = ethpipe_vma_close,
+};
 
-	// sending
-	while(!ring_empty(txq) && (--limit > 0)) {
-		len = build_ep_pkt(pdev->hw_pkt);
-		if (len < 1) {
-			pr_info("err: build_ep_pkt() len=%d\n", len);
-			goto error;
-		}
+/*
+ * ethpipe_mmap: map the control page and txq (see ethpipe_uapi.h)
+ */
+static int ethpipe_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct ep_ctx *ctx = filp->private_data;
+	unsigned long off, len = vma->vm_end - vma->vm_start;
+	uint8_t *mem;
+	int ret;
 
-		ret = ethpipe_xmit(hw_write, hw_read, len);
-		if (ret == EP_XMIT_OK) {
-			hw_write = hwtx_xmit_next(hw_write, len);
-			++pdev->tx_counter;    // incr tx_counter
-		} else if (ret == EP_XMIT_BUSY) {
-			goto out;
-		} else {
-			pr_info("err: unknown ret of ethpipe_xmit()\n");
-			goto error;
+	func_enter();
+
+	// only an open for writing has a txq to map
+	if (ctx == NULL)
+		return -EACCES;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if ((vma->vm_pgoff > (ctx->txq_mem.size >> PAGE_SHIFT)) ||
+	    (len > ctx->txq_mem.size - (vma->vm_pgoff << PAGE_SHIFT)))
+		return -EINVAL;
+
+	// no write() may be filling txq when the producer index is handed
+	// over. trylock: a write() holding it may be faulting on mmap_lock.
+	if (!mutex_trylock(&ctx->write_lock))
+		return -EBUSY;
+
+	// page by page: txq_mem may be contiguous pages or vmalloc()ed
+	mem = (uint8_t *)ctx->txq_mem.virt + (vma->vm_pgoff << PAGE_SHIFT);
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		ret = vm_insert_page(vma, vma->vm_start + off,
+				ethpipe_mem_page(&ctx->txq_mem, mem + off));
+		if (ret) {
+			pr_info("vm_insert_page failed. ret=%d\n", ret);
+			mutex_unlock(&ctx->write_lock);
+			return ret;
 		}
 	}
+	vma->vm_flags |= VM_DONTEXPAND;
 
-	// commit to NIC via pcie pio write
-	set_nic_txptr((uint32_t *)pdev->nic.tx.write, hw_write);
+	// hand the producer index over to the first mapping
+	if (atomic_read(&ctx->txq_mapped) == 0)
+		ring_ctl_push_write(&ctx->txq, ctx->txctl);
 
-	// debug
-	//dump_nic_info();
+	vma->vm_ops = &ethpipe_vm_ops;
+	vma->vm_private_data = ctx;
+	ethpipe_vma_open(vma);
+	mutex_unlock(&ctx->write_lock);
 
-out:
-	return;
+	return 0;
+}
 
-error:
-	pr_info("kthread: tx_err\n");
-	// todo: need lock
-	txq->read = txq->start;
-	txq->write = txq->start;
-	return;
+/*
+ * ethpipe_get_params
+ */
+static void ethpipe_get_params(struct ep_ioc_params *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->txq_size = pdev->txq_size;
+	p->rxq_size = pdev->rxq_size;
+	p->nr_txq = pdev->nr_txq;
+	p->tx_budget_min = tx_budget_min;
+	p->tx_budget_max = tx_budget_max;
+	p->tx_db_bytes = tx_db_bytes;
+	p->tx_db_pkts = tx_db_pkts;
+	p->tx_db_usecs = tx_db_usecs;
+	p->tx_quantum = tx_quantum;
+	p->tx_sched = tx_sched;
+	p->tx_sched_spin_ns = tx_sched_spin_ns;
+	p->busy_poll = busy_poll;
+	p->tx_spin_us = tx_spin_us;
+	p->rx_spin_us = rx_spin_us;
+	p->rx_poll_us = rx_poll_us;
 }
 
 /*
- * ethpipe_write
+ * ethpipe_set_params: all or nothing. read only fields are ignored.
  */
-static ssize_t ethpipe_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *ppos)
+static int ethpipe_set_params(const struct ep_ioc_params *p)
 {
-	uint16_t magic, frame_len, len;
-	uint8_t ts_reg;
-	bool ts_reset;
-	struct ep_ring *wrq = &pdev->wrq;
-	struct ep_ring *txq = &pdev->txq;
+	if (!is_power_of_2(p->txq_size) ||
+	    (p->txq_size < 4 * RING_ALMOST_FULL) || (p->txq_size > (1U << 30))) {
+		pr_info("ioctl: invalid txq_size=%u\n", p->txq_size);
+		return -EINVAL;
+	}
+	if ((p->tx_budget_min < 1) || (p->tx_budget_max < p->tx_budget_min)) {
+		pr_info("ioctl: invalid tx_budget=%d-%d\n",
+				p->tx_budget_min, p->tx_budget_max);
+		return -EINVAL;
+	}
+	if ((p->tx_db_bytes < 0) || (p->tx_db_pkts < 0) || (p->tx_db_usecs < 0) ||
+	    (p->tx_quantum < MIN_PKT_SIZE) || (p->tx_sched_spin_ns < 0) ||
+	    (p->tx_spin_us < 0) || (p->rx_spin_us < 0) || (p->rx_poll_us < 1)) {
+		pr_info("ioctl: invalid params\n");
+		return -EINVAL;
+	}
 
-	func_enter();
+	pdev->txq_size = p->txq_size;
+	tx_budget_min = p->tx_budget_min;
+	tx_budget_max = p->tx_budget_max;
+	tx_db_bytes = p->tx_db_bytes;
+	tx_db_pkts = p->tx_db_pkts;
+	tx_db_usecs = p->tx_db_usecs;
+	tx_quantum = p->tx_quantum;
+	tx_sched = !!p->tx_sched;
+	tx_sched_spin_ns = p->tx_sched_spin_ns;
+	busy_poll = !!p->busy_poll;
+	tx_spin_us = p->tx_spin_us;
+	rx_spin_us = p->rx_spin_us;
+	rx_poll_us = p->rx_poll_us;
 
-	// check count :todo
+	return 0;
+}
 
-	// reset wrq
-	wrq->write = wrq->start;
-	wrq->read = wrq->start;
+/*
+ * ethpipe_set_cpu: move a running kthread and remember the cpu for
+ * the next ethpipe_tx_start()/ethpipe_rx_start()
+ */
+static int ethpipe_set_cpu(const struct ep_ioc_cpu *c)
+{
+	struct ep_thread *th;
+	int ret = 0;
+
+	if ((c->cpu < -1) || (c->cpu >= (int)nr_cpu_ids) ||
+	    ((c->cpu >= 0) && !cpu_online(c->cpu)))
+		return -EINVAL;
+
+	if (c->queue == EP_IOC_RXQ) {
+		th = &pdev->rxth;
+		rx_cpu = c->cpu;
+	} else if (c->queue < pdev->nr_txq) {
+		th = &pdev->txqs[c->queue].txth;
+		tx_cpu[c->queue] = c->cpu;
+		nr_tx_cpu = max_t(int, nr_tx_cpu, c->queue + 1);
+	} else {
+		return -EINVAL;
+	}
 
-	// userland to wrq
-	if (copy_from_user((uint8_t *)wrq->write, buf, count)) {
-		pr_info("copy_from_user failed. count=%d\n", (int)count);
-		//RING_INFO(wrq);
-		//RING_INFO(txq);
-		return -EFAULT;
+	if (th->tsk) {
+		ret = set_cpus_allowed_ptr(th->tsk, (c->cpu >= 0) ?
+				cpumask_of(c->cpu) : cpu_possible_mask);
+		if (ret == 0)
+			th->cpu = c->cpu;
 	}
 
-	// Don't need check the buffer status of wrq.
-	// because wrq is always reset entering ethpipe_write.
-	ring_write_next(wrq, count);
+	return ret;
+}
 
-	// wrq to txq
-	while (!ring_empty(wrq)) {
-		// check magic code
-		magic = ring_next_magic(wrq);
-		if (magic != EP_MAGIC) {
-			pr_info("packet format error: magic=%X\n", (int)magic);
-			return -EFAULT;
-		}
+/*
+ * ethpipe_get_stats: counters of every TX queue are read under their
+ * context locks, so the snapshot does not split a kthread round
+ */
+static void ethpipe_get_stats(struct ep_ctx *ctx, struct ep_ioc_stats *st)
+{
+	int i;
 
-		// check frame length
-		frame_len = ring_next_frame_len(wrq);
-		if ((frame_len > MAX_PKT_SIZE) || (frame_len < MIN_PKT_SIZE)) {
-			pr_info("packet format error: frame_len=%X\n", (int)frame_len);
-			return -EFAULT;
-		}
+	memset(st, 0, sizeof(*st));
 
-#if 0
-		// check timestamp
-		ts_reset = ring_next_ts_reset(wrq);
-		if (ts_reset > 1) {
-			pr_info("packet format error: ts_reset=%X\n", (int)ts_reset);
-			return -EFAULT;
-		}
-		ts_reg = ring_next_ts_reg(wrq);
-		if (ts_reg >= NUM_TX_TIMESTAMP_REG) {
-			pr_info("packet format error: ts_reg=%X\n", (int)ts_reg);
-			return -EFAULT;
-		}
-#endif
+	for (i = 0; i < pdev->nr_txq; i++)
+		spin_lock_nested(&pdev->txqs[i].ctx_lock, i);
 
-		// memcpy
-		len = EP_HDR_SIZE + frame_len;
-		if (!ring_almost_full(txq)) {
-			memcpy((uint8_t *)txq->write, (uint8_t *)wrq->read, len);
-			ring_read_next(wrq, len);
-			ring_write_next_aligned(txq, len);
-		} else {
-			// return when a ring buffer reached the max size
-			pr_debug("txq is full.\n");
-			cpu_relax();
-			break;
-		}
+	for (i = 0; i < pdev->nr_txq; i++)
+		st->tx_pkts[i] = pdev->txqs[i].tx_counter;
+	st->rx_pkts = ACCESS_ONCE(pdev->rx_counter);
+	if (ctx) {
+		st->ctx_tx_pkts = ctx->tx_counter;
+		st->ctx_queued = ethpipe_txq_queued(ctx);
 	}
+	st->nr_txq = pdev->nr_txq;
 
-#if 0
-	pr_info("wrq.wr %p, wrq.rd, %p, txq.wr %p, txq.rd %p, nic.wr %d, nic.rd %d\n",
-			wrq->write, wrq->read, txq->write, txq->read,
-			*pdev->nic.tx.write, *pdev->nic.tx.read);
-#endif
-	return (count - ring_count(wrq));
+	for (i = pdev->nr_txq - 1; i >= 0; i--)
+		spin_unlock(&pdev->txqs[i].ctx_lock);
 }
 
 /*
- * ethpipe_poll
+ * ethpipe_flush: drop the records queued in the TX ring of ctx
  */
-static unsigned int ethpipe_poll(struct file* filp, poll_table* wait)
+static void ethpipe_flush(struct ep_ctx *ctx)
 {
-	unsigned int retmask = 0;
+	struct ep_txq *q = ctx->q;
+
+	// the consumer side belongs to the kthread, which holds ctx_lock
+	spin_lock(&q->ctx_lock);
+	if (atomic_read(&ctx->txq_mapped))
+		ring_ctl_pull_write(&ctx->txq, ctx->txctl);
+	ring_cons_sync(&ctx->txq);
+	ring_cons_drop(&ctx->txq);
+	ring_ctl_push_read(&ctx->txq, ctx->txctl);
+	lat_ingest_check(ctx, NULL, true);
+	spin_unlock(&q->ctx_lock);
+
+	wake_up_interruptible(&ctx->write_q);
+}
+
+/*
+ * ethpipe_ioctl (see ethpipe_uapi.h)
+ */
+static long ethpipe_ioctl(struct file *filp,
+			unsigned int cmd, unsigned long arg)
+{
+	struct ep_ctx *ctx = filp->private_data;
+	void __user *argp = (void __user *)arg;
+	struct ep_ioc_params params;
+	struct ep_ioc_stats stats;
+	struct ep_ioc_cpu cpu;
 
 	func_enter();
 
-	poll_wait(filp, &pdev->read_q, wait);
+	switch (cmd) {
+	case EP_IOC_GET_PARAMS:
+		ethpipe_get_params(&params);
+		if (copy_to_user(argp, &params, sizeof(params)))
+			return -EFAULT;
+		return 0;
 
-//	if (pdev->rxbuf.read_ptr != pdev->rxbuf.write_ptr) {
-//		retmask |= (POLLIN  | POLLRDNORM);
-//	}
+	case EP_IOC_SET_PARAMS:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&params, argp, sizeof(params)))
+			return -EFAULT;
+		return ethpipe_set_params(&params);
 
-	return retmask;
+	case EP_IOC_GET_CPU:
+		if (copy_from_user(&cpu, argp, sizeof(cpu)))
+			return -EFAULT;
+		if (cpu.queue == EP_IOC_RXQ)
+			cpu.cpu = rx_cpu;
+		else if (cpu.queue < pdev->nr_txq)
+			cpu.cpu = (cpu.queue < nr_tx_cpu) ? tx_cpu[cpu.queue] : -1;
+		else
+			return -EINVAL;
+		if (copy_to_user(argp, &cpu, sizeof(cpu)))
+			return -EFAULT;
+		return 0;
+
+	case EP_IOC_SET_CPU:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&cpu, argp, sizeof(cpu)))
+			return -EFAULT;
+		return ethpipe_set_cpu(&cpu);
+
+	case EP_IOC_DRAIN:
+		// an open without FMODE_WRITE never queues anything
+		if (ctx == NULL)
+			return 0;
+		if (wait_event_interruptible(ctx->write_q,
+				ethpipe_txq_queued(ctx) == 0))
+			return -ERESTARTSYS;
+		return 0;
+
+	case EP_IOC_FLUSH:
+		if (ctx)
+			ethpipe_flush(ctx);
+		return 0;
+
+	case EP_IOC_GET_STATS:
+		ethpipe_get_stats(ctx, &stats);
+		if (copy_to_user(argp, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+
+	return -ENOTTY;
 }
 
+
 /*
- * ethpipe_ioctl
+ * ethpipe_idle: nothing to do. sleep a tick, or spin in busy_poll mode
  */
-static long ethpipe_ioctl(struct file *filp,
-			unsigned int cmd, unsigned long arg)
+static inline void ethpipe_idle(void)
 {
-	func_enter();
+	if (!busy_poll) {
+		schedule_timeout_interruptible(1);
+		return;
+	}
 
-	return  -ENOTTY;
+	if (need_resched())
+		schedule();
+	else
+		cpu_relax();
 }
 
+/*
+ * ethpipe_tx_idle: no frames to send. spin for tx_spin_us, then sleep
+ * until write() kicks q. mmap()ed producers do not kick, so the sleep
+ * is still bounded by a tick.
+ */
+static void ethpipe_tx_idle(struct ep_txq *q, u64 *idle_since)
+{
+	// busy_poll: a dedicated cpu never sleeps
+	if (busy_poll) {
+		ethpipe_idle();
+		return;
+	}
+
+	if (*idle_since == 0)
+		*idle_since = local_clock();
+	if ((local_clock() - *idle_since) < (u64)tx_spin_us * NSEC_PER_USEC) {
+		if (need_resched())
+			schedule();
+		else
+			cpu_relax();
+		return;
+	}
 
-static int ethpipe_tx_kthread(void *unused)
+	set_current_state(TASK_INTERRUPTIBLE);
+	ACCESS_ONCE(q->sleeping) = true;
+	// pairs with the barrier in ethpipe_tx_kick()
+	smp_mb();
+	if (!ethpipe_txq_pending(q) && !kthread_should_stop())
+		schedule_timeout(1);
+	__set_current_state(TASK_RUNNING);
+	ACCESS_ONCE(q->sleeping) = false;
+
+	*idle_since = 0;
+}
+
+static int ethpipe_tx_kthread(void *data)
 {
+	struct ep_txq *q = data;
 	int cpu = smp_processor_id();
+	u64 idle_since = 0;
 
-	pr_info("starting ethpiped/%d:  pid=%d\n", cpu, task_pid_nr(current));
+	pr_info("starting ethpipe_tx/%d: cpu=%d, pid=%d\n",
+			q->idx, cpu, task_pid_nr(current));
 
 	set_current_state(TASK_INTERRUPTIBLE);
 
 	while (!kthread_should_stop()) {
 		//pr_info("[kthread] my cpu is %d (%d, HZ=%d)\n", cpu, i++, HZ);
 
-		if (pdev->txq.read == pdev->txq.write) {
-			schedule_timeout_interruptible(1);
+		__set_current_state(TASK_RUNNING);
+
+		if (!ethpipe_sched(q)) {
+			if (q->ts_next) {
+				tx_sched_wait(q->ts_next);
+				idle_since = 0;
+			} else {
+				ethpipe_tx_idle(q, &idle_since);
+			}
 			continue;
 		}
+		idle_since = 0;
+
+		if (need_resched())
+			schedule();
+		else
+			cpu_relax();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+
+	pr_info("kthread_exit: ethpipe_tx/%d\n", q->idx);
+
+	return 0;
+}
 
+/*
+ * ethpipe_rx_idle: nothing received. the NIC raises no RX interrupt,
+ * so spin for rx_spin_us, then poll every rx_poll_us on a hrtimer.
+ * a tick would let a burst overrun the DMA ring: 1 MB fills in about
+ * 800 us at 10GbE.
+ */
+static void ethpipe_rx_idle(u64 *idle_since)
+{
+	ktime_t expires;
+
+	// busy_poll: a dedicated cpu never sleeps
+	if (busy_poll) {
+		ethpipe_idle();
+		return;
+	}
+
+	if (*idle_since == 0)
+		*idle_since = local_clock();
+	if ((local_clock() - *idle_since) < (u64)rx_spin_us * NSEC_PER_USEC) {
+		if (need_resched())
+			schedule();
+		else
+			cpu_relax();
+		return;
+	}
+
+	expires = ns_to_ktime(ktime_to_ns(ktime_get()) +
+			(s64)rx_poll_us * NSEC_PER_USEC);
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!kthread_should_stop())
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	__set_current_state(TASK_RUNNING);
+}
+
+static int ethpipe_rx_kthread(void *unused)
+{
+	int cpu = smp_processor_id();
+	u64 idle_since = 0;
+
+	pr_info("starting ethpipe_rx/0: cpu=%d, pid=%d\n",
+			cpu, task_pid_nr(current));
+
+	set_current_state(TASK_INTERRUPTIBLE);
+
+	while (!kthread_should_stop()) {
 		__set_current_state(TASK_RUNNING);
 
-		ethpipe_send();
+		if (ethpipe_recv() == 0) {
+			ethpipe_rx_idle(&idle_since);
+			continue;
+		}
+		idle_since = 0;
+
 		if (need_resched())
 			schedule();
 		else
@@ -400,46 +968,303 @@ static int ethpipe_tx_kthread(void *unused)
 		set_current_state(TASK_INTERRUPTIBLE);
 	}
 
-	pr_info("kthread_exit: cpu=%d\n", cpu);
+	pr_info("kthread_exit: ethpipe_rx/0\n");
 
 	return 0;
 }
 
-static void ethpipe_pdev_free(void)
+/*
+ * ethpipe_kthread_node_affine: keep an unbound kthread on the cpus of
+ * the NIC's node, next to its rings
+ */
+static void ethpipe_kthread_node_affine(struct task_struct *tsk)
 {
-	pr_info("%s\n", __func__);
+	if (pdev->node != NUMA_NO_NODE)
+		set_cpus_allowed_ptr(tsk, cpumask_of_node(pdev->node));
+}
+
+/*
+ * ethpipe_rx_start
+ */
+static int ethpipe_rx_start(void)
+{
+	pdev->rxth.tsk = kthread_create_on_node(ethpipe_rx_kthread, NULL,
+			pdev->node, "ethpipe_rx/0");
+	if (IS_ERR(pdev->rxth.tsk)) {
+		pr_info("can't create rx thread\n");
+		pdev->rxth.tsk = NULL;
+		return -1;
+	}
+
+	pdev->rxth.cpu = -1;
+	if (rx_cpu >= 0) {
+		if (cpu_online(rx_cpu)) {
+			pdev->rxth.cpu = rx_cpu;
+			kthread_bind(pdev->rxth.tsk, pdev->rxth.cpu);
+		} else {
+			pr_info("rx_cpu=%d is offline. not bound\n", rx_cpu);
+		}
+	}
+	if (pdev->rxth.cpu < 0)
+		ethpipe_kthread_node_affine(pdev->rxth.tsk);
 
-	kthread_stop(pdev->txth.tsk);
+	wake_up_process(pdev->rxth.tsk);
 
-	/* free tx buffer */
-	if (pdev->txq.start) {
-		vfree(pdev->txq.start);
-		pdev->txq.start = NULL;
+	return 0;
+}
+
+/*
+ * ethpipe_rx_stop
+ */
+static void ethpipe_rx_stop(void)
+{
+	if (pdev->rxth.tsk) {
+		kthread_stop(pdev->rxth.tsk);
+		pdev->rxth.tsk = NULL;
 	}
+}
+
+/*
+ * ethpipe_tx_start: one TX kthread per queue, bound to tx_cpu[] if given
+ */
+static int ethpipe_tx_start(void)
+{
+	struct ep_txq *q;
+	int i;
+
+	for (i = 0; i < pdev->nr_txq; i++) {
+		q = &pdev->txqs[i];
+
+		q->txth.tsk = kthread_create_on_node(ethpipe_tx_kthread, q,
+				pdev->node, "ethpipe_tx/%d", i);
+		if (IS_ERR(q->txth.tsk)) {
+			pr_info("can't create tx thread %d\n", i);
+			q->txth.tsk = NULL;
+			goto err;
+		}
+
+		q->txth.cpu = -1;
+		if ((i < nr_tx_cpu) && (tx_cpu[i] >= 0)) {
+			if (cpu_online(tx_cpu[i])) {
+				q->txth.cpu = tx_cpu[i];
+				kthread_bind(q->txth.tsk, q->txth.cpu);
+			} else {
+				pr_info("tx_cpu[%d]=%d is offline. not bound\n",
+						i, tx_cpu[i]);
+			}
+		}
+		if (q->txth.cpu < 0)
+			ethpipe_kthread_node_affine(q->txth.tsk);
 
-	/* free write buffers */
-	if (pdev->wrq.start) {
-		vfree(pdev->wrq.start);
-		pdev->wrq.start = NULL;
+		wake_up_process(q->txth.tsk);
 	}
 
-	/* free rx buffer */
-	if (pdev->rxq.start) {
-		vfree(pdev->rxq.start);
-		pdev->rxq.start = NULL;
+	return 0;
+
+err:
+	ethpipe_tx_stop();
+	return -1;
+}
+
+/*
+ * ethpipe_tx_stop
+ */
+static void ethpipe_tx_stop(void)
+{
+	struct ep_txq *q;
+	int i;
+
+	for (i = 0; i < pdev->nr_txq; i++) {
+		q = &pdev->txqs[i];
+		if (q->txth.tsk) {
+			kthread_stop(q->txth.tsk);
+			q->txth.tsk = NULL;
+		}
 	}
+}
 
-	/* free read buffers */
-	if (pdev->rdq.start) {
-		vfree(pdev->rdq.start);
-		pdev->rdq.start = NULL;
+/*
+ * ethpipe_mem_alloc: zeroed ring memory on the NIC's NUMA node.
+ * Contiguous pages first; rings above the buddy allocator's largest
+ * block, or a fragmented node, fall back to vmalloc() on the node.
+ */
+static int ethpipe_mem_alloc(struct ep_mem *m, size_t size)
+{
+	m->size = PAGE_ALIGN(size);
+
+	if (get_order(m->size) < MAX_ORDER) {
+		m->virt = alloc_pages_exact_nid(pdev->node, m->size,
+				GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY);
+		if (m->virt) {
+			m->contig = true;
+			return 0;
+		}
+	}
+
+	m->contig = false;
+	m->virt = vzalloc_node(m->size, pdev->node);
+
+	return m->virt ? 0 : -1;
+}
+
+static void ethpipe_mem_free(struct ep_mem *m)
+{
+	if (m->virt == NULL)
+		return;
+
+	if (m->contig)
+		free_pages_exact(m->virt, m->size);
+	else
+		vfree(m->virt);
+	m->virt = NULL;
+}
+
+static struct page *ethpipe_mem_page(const struct ep_mem *m, void *p)
+{
+	return m->contig ? virt_to_page(p) : vmalloc_to_page(p);
+}
+
+static void ethpipe_ring_free(struct ep_ring *r)
+{
+	ethpipe_mem_free(&r->mem);
+	r->start = NULL;
+}
+
+static int ethpipe_ring_alloc(struct ep_ring *r, int size)
+{
+	if (ethpipe_mem_alloc(&r->mem, size + EP_HDR_SIZE + MAX_PKT_SIZE) < 0)
+		return -1;
+	r->start = r->mem.virt;
+
+	r->size  = size;
+	r->mask  = size - 1;
+	r->end   = r->start + size - 1;
+	ring_reset(r);
+
+	return 0;
+}
+
+/*
+ * ethpipe_ctx_free
+ */
+static void ethpipe_ctx_free(struct ep_ctx *ctx)
+{
+	if (ctx->part_len)
+		pr_debug("dropping a partial record: %d bytes\n", (int)ctx->part_len);
+	kfree(ctx->part);
+
+	/* free tx buffer and its control page */
+	ethpipe_mem_free(&ctx->txq_mem);
+	kfree(ctx);
+}
+
+/*
+ * ethpipe_ctx_alloc: TX context of a new open() on q
+ */
+static struct ep_ctx *ethpipe_ctx_alloc(struct ep_txq *q)
+{
+	struct ep_ctx *ctx;
+
+	ctx = kzalloc(sizeof(struct ep_ctx), GFP_KERNEL);
+	if (ctx == NULL) {
+		pr_info("fail to kmalloc: ctx\n");
+		return NULL;
 	}
 
-	/* free hw_pkt */
-	if (pdev->hw_pkt) {
-		kfree(pdev->hw_pkt);
-		pdev->hw_pkt = NULL;
+	ctx->q = q;
+	ctx->tx_avg_len = MIN_PKT_SIZE;
+
+	/* partial record of write() */
+	ctx->part = kmalloc(EP_HDR_SIZE + MAX_PKT_SIZE, GFP_KERNEL);
+	if (ctx->part == NULL) {
+		pr_info("fail to kmalloc: part\n");
+		kfree(ctx);
+		return NULL;
+	}
+
+	/* setup transmit buffer. the first page is the mmap() control page */
+	if (ethpipe_mem_alloc(&ctx->txq_mem, PAGE_SIZE +
+			PAGE_ALIGN(pdev->txq_size + EP_HDR_SIZE + MAX_PKT_SIZE)) < 0) {
+		pr_info("fail to allocate: txq\n");
+		kfree(ctx->part);
+		kfree(ctx);
+		return NULL;
 	}
+	ctx->txctl = (struct ep_ring_ctl *)ctx->txq_mem.virt;
+	ctx->txctl->size = pdev->txq_size;
+	ctx->txctl->slack = PAGE_ALIGN(pdev->txq_size + EP_HDR_SIZE + MAX_PKT_SIZE) -
+		pdev->txq_size;
+	ctx->txctl->data_off = PAGE_SIZE;
+	atomic_set(&ctx->txq_mapped, 0);
+	init_waitqueue_head(&ctx->write_q);
+	mutex_init(&ctx->write_lock);
+	spin_lock_init(&ctx->lat_lock);
+
+	ctx->txq.start = (uint8_t *)ctx->txq_mem.virt + PAGE_SIZE;
+	ctx->txq.size  = pdev->txq_size;
+	ctx->txq.mask  = pdev->txq_size - 1;
+	ctx->txq.end   = ctx->txq.start + pdev->txq_size - 1;
+	ring_reset(&ctx->txq);
+
+	return ctx;
+}
+
+/*
+ * ethpipe_txq_free
+ */
+static void ethpipe_txq_free(struct ep_txq *q)
+{
+	if (q->misc.name) {
+		misc_deregister(&q->misc);
+		q->misc.name = NULL;
+	}
+}
+
+/*
+ * ethpipe_txq_init
+ */
+static int ethpipe_txq_init(struct ep_txq *q, int idx)
+{
+	int ret;
+
+	q->idx = idx;
+	q->tx_counter = 0;
+
+	spin_lock_init(&q->ctx_lock);
+	INIT_LIST_HEAD(&q->ctx_list);
+
+	/* register character device: /dev/ethpipe/0, /dev/ethpipe/0-txN */
+	if (idx == 0)
+		sprintf(q->name, "%s/%d", DRV_NAME, 0);
+	else
+		sprintf(q->name, "%s/%d-tx%d", DRV_NAME, 0, idx);
+	q->misc.minor = MISC_DYNAMIC_MINOR;
+	q->misc.name = q->name;
+	q->misc.fops = &ethpipe_fops;
+	ret = misc_register(&q->misc);
+	if (ret) {
+		pr_info("fail to misc_register (MISC_DYNAMIC_MINOR)\n");
+		q->misc.name = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ethpipe_pdev_free(void)
+{
+	int i;
+
+	pr_info("%s\n", __func__);
+
+	for (i = 0; i < EP_MAX_TXQ; i++)
+		ethpipe_txq_free(&pdev->txqs[i]);
+
+	/* free rx buffer */
+	ethpipe_ring_free(&pdev->rxq);
+
+	/* free read buffers */
+	ethpipe_ring_free(&pdev->rdq);
 
 	/* free pdev */
 	if (pdev) {
@@ -448,20 +1273,49 @@ static void ethpipe_pdev_free(void)
 	}
 }
 
+/*
+ * ethpipe_dev_node: NUMA node of the board, looked up before the PCI
+ * driver is registered so the rings can be allocated there
+ */
+static int ethpipe_dev_node(void)
+{
+	struct pci_dev *pcidev;
+	int node = NUMA_NO_NODE;
+
+	pcidev = pci_get_device(ethpipe_pci_tbl[0].vendor,
+			ethpipe_pci_tbl[0].device, NULL);
+	if (pcidev) {
+		node = dev_to_node(&pcidev->dev);
+		pci_dev_put(pcidev);
+	}
+
+	return node;
+}
+
 static int ethpipe_pdev_init(void)
 {
+	int i;
+
 	pr_info("%s\n", __func__);
 
+	BUILD_BUG_ON(sizeof(struct ep_hw_hdr) != EP_HWHDR_SIZE);
+
 	/* malloc pdev */
-	pdev = kmalloc(sizeof(struct ep_dev), GFP_KERNEL);
+	pdev = kzalloc(sizeof(struct ep_dev), GFP_KERNEL);
 	if (pdev == 0) {
 		pr_info("fail to kmalloc: *pdev\n");
 		goto err;
 	}
 
-	pdev->tx_counter = 0;
 	pdev->rx_counter = 0;
 
+	/* rings go on the NIC's node */
+	pdev->node = ethpipe_dev_node();
+	pr_info("pdev->node: %d\n", pdev->node);
+
+	init_waitqueue_head(&pdev->read_q);
+	sema_init(&pdev->pktdev_sem, 1);
+
 	/* tx ring size from module parameter */
 	pdev->txq_size = txq_size * 1024 * 1024;
 	pr_info("pdev->txq_size: %d\n", pdev->txq_size);
@@ -470,75 +1324,43 @@ static int ethpipe_pdev_init(void)
 	pdev->rxq_size = rxq_size * 1024 * 1024;
 	pr_info("pdev->rxq_size: %d\n", pdev->rxq_size);
 
-	/* write ring size from module parameter */
-	pdev->wrq_size = wrq_size * 1024 * 1024;
-	pr_info("pdev->wrq_size: %d\n", pdev->wrq_size);
-
 	/* read ring size from module parameter */
 	pdev->rdq_size = rdq_size * 1024 * 1024;
 	pr_info("pdev->rdq_size: %d\n", pdev->rdq_size);
 
-	/* temporary buffer for build paket */
-	pdev->hw_pkt = (struct ep_hw_pkt *)kmalloc(
-			sizeof(struct ep_hw_pkt) - sizeof(uint8_t) + (sizeof(uint8_t) * MAX_PKT_SIZE),
-			GFP_KERNEL);
-	if (pdev->hw_pkt == 0) {
-		pr_info("fail to kmalloc: *pdev->hw_pkt\n");
-		goto err;
+	/* number of tx queues from module parameter */
+	pdev->nr_txq = clamp(nr_txq, 1, EP_MAX_TXQ);
+	pr_info("pdev->nr_txq: %d\n", pdev->nr_txq);
+
+	/* kthread knobs from module parameters, as ethpipe_set_params() checks them */
+	tx_budget_min = max(tx_budget_min, 1);
+	tx_budget_max = max(tx_budget_max, tx_budget_min);
+	pr_info("tx_budget: %d-%d\n", tx_budget_min, tx_budget_max);
+	tx_db_bytes = max(tx_db_bytes, 0);
+	tx_db_pkts = max(tx_db_pkts, 0);
+	tx_db_usecs = max(tx_db_usecs, 0);
+	tx_sched_spin_ns = max(tx_sched_spin_ns, 0);
+	tx_spin_us = max(tx_spin_us, 0);
+	rx_spin_us = max(rx_spin_us, 0);
+	rx_poll_us = max(rx_poll_us, 1);
+
+	spin_lock_init(&pdev->arb.lock);
+
+	/* setup transmit queues */
+	for (i = 0; i < pdev->nr_txq; i++) {
+		if (ethpipe_txq_init(&pdev->txqs[i], i) < 0)
+			goto err;
 	}
 
-	/* setup transmit buffer */
-	if ((pdev->txq.start =
-			vmalloc(pdev->txq_size + EP_HDR_SIZE + MAX_PKT_SIZE)) == 0) {
-		pr_info("fail to vmalloc: txq\n");
-		goto err;
-	}
-	pdev->txq.size  = pdev->txq_size;
-	pdev->txq.mask  = pdev->txq_size - 1;
-	pdev->txq.end   = pdev->txq.start + pdev->txq_size - 1;
-	pdev->txq.write = pdev->txq.start;
-	pdev->txq.read  = pdev->txq.start;
-
 	/* setup receive buffer */
-	if ((pdev->rxq.start =
-			vmalloc(pdev->rxq_size + EP_HDR_SIZE + MAX_PKT_SIZE)) == 0) {
-		pr_info("fail to vmalloc: rxq\n");
-		goto err;
-	}
-	pdev->rxq.size  = pdev->rxq_size;
-	pdev->rxq.mask  = pdev->rxq_size - 1;
-	pdev->rxq.end   = pdev->rxq.start + pdev->rxq_size - 1;
-	pdev->rxq.write = pdev->rxq.start;
-	pdev->rxq.read  = pdev->rxq.start;
-
-	/* setup write buffer */
-	if ((pdev->wrq.start =
-			vmalloc(pdev->wrq_size + EP_HDR_SIZE + MAX_PKT_SIZE)) == 0) {
-		pr_info("fail to vmalloc: wrq\n");
+	if (ethpipe_ring_alloc(&pdev->rxq, pdev->rxq_size) < 0) {
+		pr_info("fail to allocate: rxq\n");
 		goto err;
 	}
-	pdev->wrq.size  = pdev->wrq_size;
-	pdev->wrq.mask  = pdev->wrq_size - 1;
-	pdev->wrq.end   = pdev->wrq.start + pdev->wrq_size - 1;
-	pdev->wrq.write = pdev->wrq.start;
-	pdev->wrq.read  = pdev->wrq.start;
 
 	/* setup read buffer */
-	if ((pdev->rdq.start =
-			vmalloc(pdev->rdq_size + EP_HDR_SIZE + MAX_PKT_SIZE)) == 0) {
-		pr_info("fail to vmalloc: rdq\n");
-		goto err;
-	}
-	pdev->rdq.size  = pdev->rdq_size;
-	pdev->rdq.mask  = pdev->rdq_size - 1;
-	pdev->rdq.end   = pdev->rdq.start + pdev->rdq_size - 1;
-	pdev->rdq.write = pdev->rdq.start;
-	pdev->rdq.read  = pdev->rdq.start;
-
-	// create tx thread
-	pdev->txth.tsk = kthread_run(ethpipe_tx_kthread, NULL, "tx_kthread");
-	if (IS_ERR(pdev->txth.tsk)) {
-		pr_info("can't create tx thread\n");
+	if (ethpipe_ring_alloc(&pdev->rdq, pdev->rdq_size) < 0) {
+		pr_info("fail to allocate: rdq\n");
 		goto err;
 	}
 
@@ -548,6 +1370,25 @@ err:
 	return -1;
 }
 
+/*
+ * ethpipe_rx_dma_free: stop the NIC's RX DMA, then free its ring
+ */
+static void ethpipe_rx_dma_free(struct pci_dev *pcidev)
+{
+	struct mmio *mmio0 = &pdev->nic.mmio0;
+
+	if (pdev->nic.rx.virt == NULL)
+		return;
+
+	*(uint32_t *)(mmio0->virt + RX0_DMA_ADDR) = 0;
+	*(uint32_t *)(mmio0->virt + RX0_DMA_LEN) = 0;
+	pci_clear_master(pcidev);
+
+	dma_free_coherent(&pcidev->dev, pdev->nic.rx.size,
+			pdev->nic.rx.virt, pdev->nic.rx.phys);
+	pdev->nic.rx.virt = NULL;
+}
+
 /*
  * ethpipe_nic_init()
  */
@@ -563,11 +1404,11 @@ static int ethpipe_nic_init(struct pci_dev *pcidev,
 
 	rc = pci_enable_device(pcidev);
 	if (rc)
-		goto error;
+		return rc;
 
 	rc = pci_request_regions(pcidev, DRV_NAME);
 	if (rc)
-		goto error;
+		goto err_disable;
 
 	/* set BUS master */
 	pci_set_master(pcidev);
@@ -580,7 +1421,7 @@ static int ethpipe_nic_init(struct pci_dev *pcidev,
 	mmio0->virt = ioremap(mmio0->start, mmio0->len);
 	if(!mmio0->virt) {
 		pr_info("cannot ioremap MMIO0 base\n");
-		goto error;
+		goto err_release;
 	}
 	pr_info("mmio0_start: %X\n", (unsigned int)mmio0->start);
 	pr_info("mmio0_end  : %X\n", (unsigned int)mmio0->end);
@@ -595,7 +1436,7 @@ static int ethpipe_nic_init(struct pci_dev *pcidev,
 	mmio1->virt = ioremap_wc(mmio1->start, mmio1->len);
 	if (!mmio1->virt) {
 		pr_info("cannot ioremap MMIO1 base\n");
-		goto error;
+		goto err_unmap0;
 	}
 	pr_info("mmio1_virt : %p\n", mmio1->virt);
 	pr_info("mmio1_start: %X\n", (unsigned int)mmio1->start);
@@ -604,12 +1445,29 @@ static int ethpipe_nic_init(struct pci_dev *pcidev,
 	pr_info("mmio1_len  : %X\n", (unsigned int)mmio1->len);
 
 
+	/* RX DMA ring */
+	rc = pci_set_dma_mask(pcidev, DMA_BIT_MASK(32));
+	if (rc) {
+		pr_info("no usable 32bit DMA\n");
+		goto err_unmap1;
+	}
+	nic->rx.virt = dma_alloc_coherent(&pcidev->dev, DMA_BUF_MAX,
+			&nic->rx.phys, GFP_KERNEL);
+	if (!nic->rx.virt) {
+		pr_info("fail to dma_alloc_coherent: rx\n");
+		goto err_unmap1;
+	}
+	nic->rx.size = DMA_BUF_MAX;
+	nic->rx.mask = nic->rx.size - 1;
+	nic->pcidev = pcidev;
+
 	/* initial NIC hardware registers */
-	*(long     *)(mmio0->virt + 0x14) = DMA_BUF_MAX; /* set DMA Buffer length */
+	*(uint32_t *)(mmio0->virt + RX0_DMA_ADDR) = (uint32_t)nic->rx.phys; /* set DMA Buffer address */
+	*(uint32_t *)(mmio0->virt + RX0_DMA_LEN) = DMA_BUF_MAX; /* set DMA Buffer length */
 	//*(uint32_t *)(mmio0->virt + 0x30) = 0;
 	//*(uint32_t *)(mmio1->virt + 0x34) = 0;
-	*(long     *)(mmio0->virt + 0x80) = 1; /* set min disable interrupt cycles (@125MHz) */
-	*(long     *)(mmio0->virt + 0x84) = 0xffffffff; /* set max enable interrupt cycles (@125MHz) */
+	*(uint32_t *)(mmio0->virt + 0x80) = 1; /* set min disable interrupt cycles (@125MHz) */
+	*(uint32_t *)(mmio0->virt + 0x84) = 0xffffffff; /* set max enable interrupt cycles (@125MHz) */
 
 	/* pointer of NIC registers */
 	nic->tx.start = (uint32_t *)(mmio0->virt);
@@ -623,10 +1481,38 @@ static int ethpipe_nic_init(struct pci_dev *pcidev,
 	pr_info("nic->tx.end: %p\n", nic->tx.end);
 	pr_info("nic->tx.size: %X\n", (unsigned int)nic->tx.size);
 
+	nic->rx.write = (uint32_t *)(mmio0->virt + RX0_WRITE_ADDR);
+	nic->rx.read = (uint32_t *)(mmio0->virt + RX0_READ_ADDR);
+	set_nic_txptr((uint32_t *)nic->rx.read, read_nic_txptr((uint32_t *)nic->rx.write));
+	pr_info("nic->rx.phys: %llX\n", (unsigned long long)nic->rx.phys);
+
+	/* TX window arbiter starts from the NIC pointers. from here on the
+	   write pointer is only written, the read pointer read on demand */
+	pdev->arb.hw_write = read_nic_txptr((uint32_t *)nic->tx.write);
+	pdev->arb.hw_commit = pdev->arb.hw_write;
+	pdev->arb.hw_read = read_nic_txptr((uint32_t *)nic->tx.read);
+
+	if (ethpipe_tx_start() < 0)
+		goto err_free_rx;
+
+	if (ethpipe_rx_start() < 0)
+		goto err_stop_tx;
+
 	return 0;
 
-error:
+err_stop_tx:
+	ethpipe_tx_stop();
+err_free_rx:
+	ethpipe_rx_dma_free(pcidev);
+err_unmap1:
+	iounmap(mmio1->virt);
+	mmio1->virt = 0;
+err_unmap0:
+	iounmap(mmio0->virt);
+	mmio0->virt = 0;
+err_release:
 	pci_release_regions(pcidev);
+err_disable:
 	pci_disable_device(pcidev);
 	return -1;
 }
@@ -641,9 +1527,15 @@ static void ethpipe_nic_remove(struct pci_dev *pcidev)
 
 	pr_info("%s\n", __func__);
 
+	ethpipe_rx_stop();
+	ethpipe_tx_stop();
+
 	*(uint32_t *)(mmio0->virt + 0x30) = 0;
 	*(uint32_t *)(mmio1->virt + 0x34) = 0;
 
+	// the NIC must be done with the RX ring before it is freed
+	ethpipe_rx_dma_free(pcidev);
+
 	if (mmio0->virt) {
 		iounmap(mmio0->virt);
 		mmio0->virt = 0;
@@ -653,8 +1545,6 @@ static void ethpipe_nic_remove(struct pci_dev *pcidev)
 		mmio1->virt = 0;
 	}
 
-	ethpipe_pdev_free();
-
 	pci_release_regions(pcidev);
 	pci_disable_device(pcidev);
 }
@@ -664,28 +1554,30 @@ static void ethpipe_nic_remove(struct pci_dev *pcidev)
  */
 static int __init ethpipe_init(void)
 {
-	int ret = 0, idx = 0;
-	static char name[16];
+	int ret = 0;
 
 	pr_info("%s\n", __func__);
 
-	/* register character device */
-	sprintf(name, "%s/%d", DRV_NAME, idx);
-	ethpipe_dev.name = name;
-	ret = misc_register(&ethpipe_dev);
-	if (ret) {
-		pr_info("fail to misc_register (MISC_DYNAMIC_MINOR)\n");
+	/* rings and character devices of each tx queue */
+	ret = ethpipe_pdev_init();
+	if (ret < 0)
 		goto error;
-	}
 
-	ret = ethpipe_pdev_init();
+	/* /proc/driver/ethpipe/stats */
+	ret = ethpipe_procfs_init(pdev->nr_txq);
 	if (ret < 0)
 		goto error;
 
-	return pci_register_driver(&ethpipe_pci_driver);
+	ret = pci_register_driver(&ethpipe_pci_driver);
+	if (ret < 0)
+		goto error;
+
+	return 0;
 
 error:
-	pci_unregister_driver(&ethpipe_pci_driver);
+	ethpipe_procfs_exit();
+	if (pdev)
+		ethpipe_pdev_free();
 	return -1;
 }
 
@@ -696,8 +1588,9 @@ static void __exit ethpipe_cleanup(void)
 {
 	pr_info("%s\n", __func__);
 
-	misc_deregister(&ethpipe_dev);
 	pci_unregister_driver(&ethpipe_pci_driver);
+	ethpipe_procfs_exit();
+	ethpipe_pdev_free();
 }
 
 
@@ -711,11 +1604,44 @@ MODULE_VERSION(VERSION);
 module_param(debug, int, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(debug, "Enable debug mode");
 module_param(txq_size, int, S_IRUGO);
-MODULE_PARM_DESC(txq_size, "TX ring size on each xmit kthread (MB)");
+MODULE_PARM_DESC(txq_size, "TX ring size of each open() of a TX queue (MB)");
+module_param(nr_txq, int, S_IRUGO);
+MODULE_PARM_DESC(nr_txq, "Number of TX queues (/dev/ethpipe/0, /dev/ethpipe/0-txN)");
+module_param_array(tx_cpu, int, &nr_tx_cpu, S_IRUGO);
+MODULE_PARM_DESC(tx_cpu, "CPU list to bind the TX kthreads to, one per queue");
+module_param(rx_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(rx_cpu, "CPU to bind the RX kthread to");
 module_param(rxq_size, int, S_IRUGO);
 MODULE_PARM_DESC(rxq_size, "RX ring size on each recv kthread (MB)");
-module_param(wrq_size, int, S_IRUGO);
-MODULE_PARM_DESC(wrq_size, "Write ring size on ep_write (dMB)");
 module_param(rdq_size, int, S_IRUGO);
 MODULE_PARM_DESC(rdq_size, "Read ring size on ep_read (MB)");
+/* read only: EP_IOC_SET_PARAMS range checks these, change them through it */
+module_param(tx_budget_min, int, S_IRUGO);
+MODULE_PARM_DESC(tx_budget_min, "Min frames sent per kthread round");
+module_param(tx_budget_max, int, S_IRUGO);
+MODULE_PARM_DESC(tx_budget_max, "Max frames sent per kthread round");
+module_param(tx_db_bytes, int, S_IRUGO);
+MODULE_PARM_DESC(tx_db_bytes, "Ring the TX doorbell after this many pending bytes");
+module_param(tx_db_pkts, int, S_IRUGO);
+MODULE_PARM_DESC(tx_db_pkts, "Ring the TX doorbell after this many pending frames");
+module_param(tx_db_usecs, int, S_IRUGO);
+MODULE_PARM_DESC(tx_db_usecs, "Ring the TX doorbell when a frame waited this long (us)");
+module_param(tx_sched_spin_ns, int, S_IRUGO);
+MODULE_PARM_DESC(tx_sched_spin_ns, "Busy-wait this long before a scheduled frame is due (ns)");
+module_param(tx_spin_us, int, S_IRUGO);
+MODULE_PARM_DESC(tx_spin_us, "Idle TX kthread spins this long before it sleeps (us)");
+module_param(rx_spin_us, int, S_IRUGO);
+MODULE_PARM_DESC(rx_spin_us, "Idle RX kthread spins this long before it sleeps (us)");
+module_param(rx_poll_us, int, S_IRUGO);
+MODULE_PARM_DESC(rx_poll_us, "Idle RX kthread polls the NIC this often (us)");
+module_param(tx_quantum, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_quantum, "Bytes a TX context may send per scheduling round");
+module_param(tx_sched, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_sched, "Hold each frame until its timestamp in software (8ns units)");
+module_param(busy_poll, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(busy_poll, "Idle kthreads spin instead of sleeping a tick");
+module_param(tx_wc_simd, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_wc_simd, "Copy larger frames to the TX window in SSE2 full-line stores (x86_64)");
+module_param(lat_hist, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(lat_hist, "Sample TX latencies into /proc/driver/ethpipe/latency");
 
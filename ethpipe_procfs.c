@@ -0,0 +1,181 @@
+#undef pr_fmt
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include "ethpipe_procfs.h"
+
+#define EP_PROC_DIR "driver/ethpipe"
+
+DEFINE_PER_CPU(struct ep_stats, ep_stats);
+struct ep_hwm ep_hwm;
+
+static const char * const ep_stat_names[EP_STAT_NR] = {
+	[EP_STAT_WRITE_PKTS]  = "write_pkts",
+	[EP_STAT_WRITE_BYTES] = "write_bytes",
+	[EP_STAT_WRITE_FULL]  = "write_full",
+	[EP_STAT_TX_PKTS]     = "tx_pkts",
+	[EP_STAT_TX_BYTES]    = "tx_bytes",
+	[EP_STAT_TX_FMT_ERR]  = "tx_fmt_err",
+	[EP_STAT_TX_BUSY]     = "tx_busy",
+	[EP_STAT_TX_DOORBELL] = "tx_doorbell",
+	[EP_STAT_TX_PTR_READ] = "tx_ptr_read",
+	[EP_STAT_RX_PKTS]     = "rx_pkts",
+	[EP_STAT_RX_BYTES]    = "rx_bytes",
+	[EP_STAT_RX_FMT_ERR]  = "rx_fmt_err",
+	[EP_STAT_RX_FULL]     = "rx_full",
+};
+
+static const char * const ep_lat_names[EP_LAT_NR] = {
+	[EP_LAT_INGEST]   = "ingest_dequeue",
+	[EP_LAT_DOORBELL] = "dequeue_doorbell",
+	[EP_LAT_HW]       = "doorbell_hw",
+};
+
+static struct proc_dir_entry *ep_proc_dir;
+static int ep_proc_nr_txq;
+
+/*
+ * ethpipe_stats_show: "name value" per line, counters summed over cpus
+ */
+static int ethpipe_stats_show(struct seq_file *m, void *v)
+{
+	u64 sum[EP_STAT_NR];
+	struct ep_stats *st;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(sum));
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&ep_stats, cpu);
+		for (i = 0; i < EP_STAT_NR; i++)
+			sum[i] += ACCESS_ONCE(st->cnt[i]);
+	}
+
+	for (i = 0; i < EP_STAT_NR; i++)
+		seq_printf(m, "%s %llu\n", ep_stat_names[i], (unsigned long long)sum[i]);
+
+	for (i = 0; i < ep_proc_nr_txq; i++)
+		seq_printf(m, "txq%d_hwm %u\n", i, ACCESS_ONCE(ep_hwm.txq[i]));
+	seq_printf(m, "nic_tx_hwm %u\n", ACCESS_ONCE(ep_hwm.nic_tx));
+	seq_printf(m, "rxq_hwm %u\n", ACCESS_ONCE(ep_hwm.rxq));
+
+	return 0;
+}
+
+static int ethpipe_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ethpipe_stats_show, NULL);
+}
+
+/*
+ * ethpipe_stats_write: any write clears the high-water marks
+ */
+static ssize_t ethpipe_stats_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	memset(&ep_hwm, 0, sizeof(ep_hwm));
+
+	return count;
+}
+
+static const struct file_operations ethpipe_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ethpipe_stats_open,
+	.read = seq_read,
+	.write = ethpipe_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * ethpipe_latency_show: "name lo_ns hi_ns count" per non-empty bucket,
+ * counts summed over cpus
+ */
+static int ethpipe_latency_show(struct seq_file *m, void *v)
+{
+	u64 sum[EP_LAT_BUCKETS];
+	struct ep_stats *st;
+	int cpu, i, n;
+
+	for (i = 0; i < EP_LAT_NR; i++) {
+		memset(sum, 0, sizeof(sum));
+
+		for_each_possible_cpu(cpu) {
+			st = per_cpu_ptr(&ep_stats, cpu);
+			for (n = 0; n < EP_LAT_BUCKETS; n++)
+				sum[n] += ACCESS_ONCE(st->lat[i][n]);
+		}
+
+		for (n = 0; n < EP_LAT_BUCKETS; n++) {
+			if (sum[n] == 0)
+				continue;
+			seq_printf(m, "%s %llu %llu %llu\n", ep_lat_names[i],
+					n ? (1ULL << (n - 1)) : 0ULL,
+					(n < EP_LAT_BUCKETS - 1) ? (1ULL << n) - 1 : ~0ULL,
+					(unsigned long long)sum[n]);
+		}
+	}
+
+	return 0;
+}
+
+static int ethpipe_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ethpipe_latency_show, NULL);
+}
+
+static const struct file_operations ethpipe_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = ethpipe_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * ethpipe_procfs_init
+ */
+int ethpipe_procfs_init(int nr_txq)
+{
+	ep_proc_nr_txq = nr_txq;
+
+	ep_proc_dir = proc_mkdir(EP_PROC_DIR, NULL);
+	if (ep_proc_dir == NULL) {
+		pr_info("fail to proc_mkdir: %s\n", EP_PROC_DIR);
+		return -1;
+	}
+
+	if (proc_create("stats", S_IRUGO | S_IWUSR, ep_proc_dir,
+			&ethpipe_stats_fops) == NULL) {
+		pr_info("fail to proc_create: %s/stats\n", EP_PROC_DIR);
+		ethpipe_procfs_exit();
+		return -1;
+	}
+
+	if (proc_create("latency", S_IRUGO, ep_proc_dir,
+			&ethpipe_latency_fops) == NULL) {
+		pr_info("fail to proc_create: %s/latency\n", EP_PROC_DIR);
+		ethpipe_procfs_exit();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * ethpipe_procfs_exit
+ */
+void ethpipe_procfs_exit(void)
+{
+	if (ep_proc_dir) {
+		remove_proc_entry("latency", ep_proc_dir);
+		remove_proc_entry("stats", ep_proc_dir);
+		remove_proc_entry(EP_PROC_DIR, NULL);
+		ep_proc_dir = NULL;
+	}
+}
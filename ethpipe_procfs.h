@@ -0,0 +1,97 @@
+#ifndef _ETHPIPE_PROCFS_H_
+#define _ETHPIPE_PROCFS_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#else
+#include "bench/ep_shim.h"
+#endif
+#include "ethpipe_uapi.h"
+
+/*
+ * Datapath statistics, printed by /proc/driver/ethpipe/stats
+ */
+enum ep_stat_item {
+	EP_STAT_WRITE_PKTS,       /* records queued by write() */
+	EP_STAT_WRITE_BYTES,
+	EP_STAT_WRITE_FULL,       /* write() found its ring full */
+	EP_STAT_TX_PKTS,          /* frames copied to the NIC TX window */
+	EP_STAT_TX_BYTES,
+	EP_STAT_TX_FMT_ERR,       /* malformed records from write() or mmap() */
+	EP_STAT_TX_BUSY,          /* NIC TX window had no room for a batch */
+	EP_STAT_TX_DOORBELL,      /* NIC write pointer updates */
+	EP_STAT_TX_PTR_READ,      /* NIC read pointer reads */
+	EP_STAT_RX_PKTS,
+	EP_STAT_RX_BYTES,
+	EP_STAT_RX_FMT_ERR,
+	EP_STAT_RX_FULL,          /* rxq had no room, frames left in the NIC */
+	EP_STAT_NR,
+};
+
+/*
+ * Latency histograms, printed by /proc/driver/ethpipe/latency.
+ * Bucket n counts samples of [2^(n-1), 2^n) ns, bucket 0 counts 0 ns.
+ */
+enum ep_lat_item {
+	EP_LAT_INGEST,            /* write() commit to kthread dequeue */
+	EP_LAT_DOORBELL,          /* dequeue to the doorbell covering it */
+	EP_LAT_HW,                /* doorbell to nic.tx.read passing it */
+	EP_LAT_NR,
+};
+
+#define EP_LAT_BUCKETS     32
+
+/* per-cpu 64-bit counters. each cpu only adds to its own */
+struct ep_stats {
+	u64 cnt[EP_STAT_NR];
+	u64 lat[EP_LAT_NR][EP_LAT_BUCKETS];
+};
+
+/* ring occupancy high-water marks (bytes). one writer each */
+struct ep_hwm {
+	u32 txq[EP_NR_TXQ_MAX];   /* largest TX ring backlog seen by the kthread */
+	u32 nic_tx;               /* NIC TX window in use */
+	u32 rxq;
+};
+
+DECLARE_PER_CPU(struct ep_stats, ep_stats);
+extern struct ep_hwm ep_hwm;
+
+static inline void ep_stat_add(enum ep_stat_item item, u64 val)
+{
+	this_cpu_add(ep_stats.cnt[item], val);
+}
+
+static inline void ep_stat_inc(enum ep_stat_item item)
+{
+	this_cpu_inc(ep_stats.cnt[item]);
+}
+
+/* timestamps are only taken while the lat_hist module parameter is set */
+static inline s64 ep_lat_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static inline void ep_lat_add(enum ep_lat_item item, s64 ns)
+{
+	int n = (ns > 0) ? fls64(ns) : 0;
+
+	if (n >= EP_LAT_BUCKETS)
+		n = EP_LAT_BUCKETS - 1;
+	this_cpu_inc(ep_stats.lat[item][n]);
+}
+
+static inline void ep_hwm_update(u32 *hwm, u32 val)
+{
+	if (val > *hwm)
+		ACCESS_ONCE(*hwm) = val;
+}
+
+int ethpipe_procfs_init(int nr_txq);
+void ethpipe_procfs_exit(void);
+
+#endif /* _ETHPIPE_PROCFS_H_ */
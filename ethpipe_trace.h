@@ -0,0 +1,176 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ethpipe
+
+#if !defined(_ETHPIPE_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _ETHPIPE_TRACE_H_
+
+#ifdef __KERNEL__
+#include <linux/tracepoint.h>
+#endif
+
+/*
+ * TX hot path tracepoints: /sys/kernel/debug/tracing/events/ethpipe/
+ * Each costs a static branch while disabled.
+ */
+
+TRACE_EVENT(ethpipe_write,
+	TP_PROTO(int txq, size_t count, size_t done, int npkts, int err),
+	TP_ARGS(txq, count, done, npkts, err),
+	TP_STRUCT__entry(
+		__field(int, txq)
+		__field(size_t, count)
+		__field(size_t, done)
+		__field(int, npkts)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->txq = txq;
+		__entry->count = count;
+		__entry->done = done;
+		__entry->npkts = npkts;
+		__entry->err = err;
+	),
+	TP_printk("txq=%d count=%zu done=%zu npkts=%d err=%d",
+		__entry->txq, __entry->count, __entry->done,
+		__entry->npkts, __entry->err)
+);
+
+TRACE_EVENT(ethpipe_build_pkt,
+	TP_PROTO(u16 len, u64 ts),
+	TP_ARGS(len, ts),
+	TP_STRUCT__entry(
+		__field(u16, len)
+		__field(u64, ts)
+	),
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->ts = ts;
+	),
+	TP_printk("len=%u ts=%llx", __entry->len,
+		(unsigned long long)__entry->ts)
+);
+
+TRACE_EVENT(ethpipe_xmit,
+	TP_PROTO(int txq, u32 hw_write, int len),
+	TP_ARGS(txq, hw_write, len),
+	TP_STRUCT__entry(
+		__field(int, txq)
+		__field(u32, hw_write)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->txq = txq;
+		__entry->hw_write = hw_write;
+		__entry->len = len;
+	),
+	TP_printk("txq=%d hw_write=%x len=%d",
+		__entry->txq, __entry->hw_write, __entry->len)
+);
+
+/* a copy split at the end of the NIC TX window */
+TRACE_EVENT(ethpipe_xmit_wrap,
+	TP_PROTO(u32 wr, u32 len, u32 head),
+	TP_ARGS(wr, len, head),
+	TP_STRUCT__entry(
+		__field(u32, wr)
+		__field(u32, len)
+		__field(u32, head)
+	),
+	TP_fast_assign(
+		__entry->wr = wr;
+		__entry->len = len;
+		__entry->head = head;
+	),
+	TP_printk("wr=%x len=%u head=%u tail=%u",
+		__entry->wr, __entry->len, __entry->head,
+		__entry->len - __entry->head)
+);
+
+TRACE_EVENT(ethpipe_send,
+	TP_PROTO(int txq, int npkts, int bytes, u32 hw_read, u32 hw_write),
+	TP_ARGS(txq, npkts, bytes, hw_read, hw_write),
+	TP_STRUCT__entry(
+		__field(int, txq)
+		__field(int, npkts)
+		__field(int, bytes)
+		__field(u32, hw_read)
+		__field(u32, hw_write)
+	),
+	TP_fast_assign(
+		__entry->txq = txq;
+		__entry->npkts = npkts;
+		__entry->bytes = bytes;
+		__entry->hw_read = hw_read;
+		__entry->hw_write = hw_write;
+	),
+	TP_printk("txq=%d npkts=%d bytes=%d hw_read=%x hw_write=%x",
+		__entry->txq, __entry->npkts, __entry->bytes,
+		__entry->hw_read, __entry->hw_write)
+);
+
+/* the NIC TX window had no room for a batch */
+TRACE_EVENT(ethpipe_tx_busy,
+	TP_PROTO(int txq, int npkts, u32 hw_read, u32 hw_write),
+	TP_ARGS(txq, npkts, hw_read, hw_write),
+	TP_STRUCT__entry(
+		__field(int, txq)
+		__field(int, npkts)
+		__field(u32, hw_read)
+		__field(u32, hw_write)
+	),
+	TP_fast_assign(
+		__entry->txq = txq;
+		__entry->npkts = npkts;
+		__entry->hw_read = hw_read;
+		__entry->hw_write = hw_write;
+	),
+	TP_printk("txq=%d npkts=%d hw_read=%x hw_write=%x",
+		__entry->txq, __entry->npkts,
+		__entry->hw_read, __entry->hw_write)
+);
+
+TRACE_EVENT(ethpipe_doorbell,
+	TP_PROTO(u32 hw_commit, u32 pkts, u32 bytes),
+	TP_ARGS(hw_commit, pkts, bytes),
+	TP_STRUCT__entry(
+		__field(u32, hw_commit)
+		__field(u32, pkts)
+		__field(u32, bytes)
+	),
+	TP_fast_assign(
+		__entry->hw_commit = hw_commit;
+		__entry->pkts = pkts;
+		__entry->bytes = bytes;
+	),
+	TP_printk("hw_commit=%x pkts=%u bytes=%u",
+		__entry->hw_commit, __entry->pkts, __entry->bytes)
+);
+
+/* one kthread round over the contexts of a TX queue */
+TRACE_EVENT(ethpipe_tx_round,
+	TP_PROTO(int txq, bool backlog, s64 ts_next),
+	TP_ARGS(txq, backlog, ts_next),
+	TP_STRUCT__entry(
+		__field(int, txq)
+		__field(bool, backlog)
+		__field(s64, ts_next)
+	),
+	TP_fast_assign(
+		__entry->txq = txq;
+		__entry->backlog = backlog;
+		__entry->ts_next = ts_next;
+	),
+	TP_printk("txq=%d backlog=%d ts_next=%lld",
+		__entry->txq, __entry->backlog, (long long)__entry->ts_next)
+);
+
+#endif /* _ETHPIPE_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ethpipe_trace
+#ifdef __KERNEL__
+#include <trace/define_trace.h>
+#endif
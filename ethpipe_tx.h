@@ -0,0 +1,697 @@
+#ifndef _ETHPIPE_TX_H_
+#define _ETHPIPE_TX_H_
+
+/*
+ * TX datapath: txq records to the NIC TX window.
+ * Shared by the driver and the userspace build in bench/.
+ */
+
+#include "ethpipe.h"
+#include "ethpipe_trace.h"
+
+/*
+ * ep_rec_frame_len: validate the EP header of a txq record.
+ * returns the frame length, or 0 on a format error.
+ */
+static inline int ep_rec_frame_len(const uint8_t *rec)
+{
+	uint16_t magic, frame_len;
+	uint8_t ts_reg;
+
+	// check magic code
+	magic = ep_rec_magic(rec);
+	if (magic != EP_MAGIC) {
+		pr_info("packet format error: magic=%X\n", (int)magic);
+		ep_stat_inc(EP_STAT_TX_FMT_ERR);
+		return 0;
+	}
+	// check frame length
+	frame_len = ep_rec_len(rec);
+	if ((frame_len > MAX_PKT_SIZE) || (frame_len < MIN_PKT_SIZE)) {
+		pr_info("packet format error: frame_len=%X\n", (int)frame_len);
+		ep_stat_inc(EP_STAT_TX_FMT_ERR);
+		return 0;
+	}
+	// check timestamp register
+	ts_reg = ep_ts_reg(ep_rec_timestamp(rec));
+	if (ts_reg >= NUM_TX_TIMESTAMP_REG) {
+		pr_info("packet format error: ts_reg=%X\n", (int)ts_reg);
+		ep_stat_inc(EP_STAT_TX_FMT_ERR);
+		return 0;
+	}
+
+	return frame_len;
+}
+
+/*
+ * build_ep_pkt: convert the EP header at txq->read into the NIC header.
+ * The frame itself stays in txq and is streamed to the NIC by xmit().
+ * frame_len is the length validated when the batch was collected: a
+ * mmap()ed producer may rewrite the header since, so it is not read again.
+ */
+static inline void build_ep_pkt(struct ep_ring *txq, struct ep_hw_hdr *hdr,
+		uint16_t frame_len)
+{
+	uint64_t ts = ring_next_timestamp(txq);
+
+	hdr->len = cpu_to_be16(frame_len);
+	hdr->hash = 0;
+	// value, register and reset bits. reserved bits are cleared
+	hdr->ts = cpu_to_be64(ep_ts_val(ts) |
+			((uint64_t)ep_ts_reg(ts) << EP_TS_REG_SHIFT) |
+			(ep_ts_reset(ts) ? EP_TS_RESET : 0));
+	trace_ethpipe_build_pkt(frame_len, ts);
+	//hdr->ts = ring_next_timestamp(txq);
+}
+
+/*
+ * hwtx_free_count: free bytes in the NIC TX window
+ */
+static inline uint32_t hwtx_free_count(uint32_t wr, uint32_t rd)
+{
+	return ((rd - wr - 1) & pdev->nic.tx.mask);
+}
+
+#ifdef __KERNEL__
+#define EP_XMM_CLOBBER     "memory"    // the kernel itself never uses xmm
+#else
+#define EP_XMM_CLOBBER     "memory", "xmm0", "xmm1", "xmm2", "xmm3"
+#endif
+
+/*
+ * wc_copy_lines: n bytes (whole lines) to the line aligned dst. Four
+ * 16-byte non-temporal stores fill a WC buffer, so each line leaves
+ * as one full-line write. caller holds wc_begin().
+ */
+static inline void wc_copy_lines(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+#ifdef __x86_64__
+	for (; n; n -= EP_WC_LINE, src += EP_WC_LINE, dst += EP_WC_LINE) {
+		asm volatile(
+			"movdqu    (%0), %%xmm0\n\t"
+			"movdqu  16(%0), %%xmm1\n\t"
+			"movdqu  32(%0), %%xmm2\n\t"
+			"movdqu  48(%0), %%xmm3\n\t"
+			"movntdq %%xmm0,   (%1)\n\t"
+			"movntdq %%xmm1, 16(%1)\n\t"
+			"movntdq %%xmm2, 32(%1)\n\t"
+			"movntdq %%xmm3, 48(%1)\n\t"
+			: : "r" (src), "r" (dst) : EP_XMM_CLOBBER);
+	}
+#else
+	memcpy(dst, src, n);
+#endif
+}
+
+/*
+ * wc_copy: copy to the write-combining TX window. With simd the bytes
+ * up to the next line boundary are stored as they are, the lines that
+ * follow whole, and the tail as it is. Frames are packed at 2 bytes
+ * in the window, so a frame shares its first and last line with its
+ * neighbours; those stores are consecutive and combine in the same
+ * WC buffer. The last line of a batch is flushed by the wmb() before
+ * the doorbell.
+ */
+static inline void wc_copy(uint8_t *dst, const uint8_t *src, uint32_t len,
+		bool simd)
+{
+	uint32_t head, lines;
+
+	if (!simd || (len < 2 * EP_WC_LINE)) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	head = -(unsigned long)dst & (EP_WC_LINE - 1);
+	memcpy(dst, src, head);
+	lines = (len - head) & ~(EP_WC_LINE - 1);
+	wc_copy_lines(dst + head, src + head, lines);
+	memcpy(dst + head + lines, src + head + lines, len - head - lines);
+}
+
+/*
+ * wc_begin: simd stores for a batch of bytes in npkts frames. the fpu
+ * state save only pays off for larger frames.
+ * returns true if wc_end() has to follow.
+ */
+static inline bool wc_begin(uint32_t bytes, int npkts)
+{
+#ifdef __x86_64__
+	if (tx_wc_simd && (bytes >= (uint32_t)npkts * EP_WC_SIMD_MIN)) {
+		kernel_fpu_begin();
+		return true;
+	}
+#endif
+	return false;
+}
+
+static inline void wc_end(void)
+{
+#ifdef __x86_64__
+	kernel_fpu_end();
+#endif
+}
+
+/*
+ * xmit_copy: copy to the TX window at wr, wrapping at the window end.
+ * returns the TX window offset following the copied data.
+ */
+static inline uint32_t xmit_copy(uint32_t wr, const void *src, uint32_t len,
+		bool simd)
+{
+	uint8_t *nic_virt = pdev->nic.mmio1.virt;
+	uint32_t tmp;
+
+	if ((wr + len) < pdev->nic.tx.size) {
+		wc_copy(nic_virt + wr, src, len, simd);
+		return wr + len;
+	}
+
+	tmp = pdev->nic.tx.size - wr;
+	//pr_info("overwriting: wr=%d, tmp=%d\n", wr, tmp);
+	trace_ethpipe_xmit_wrap(wr, len, tmp);
+	wc_copy(nic_virt + wr, src, tmp, simd);
+	wc_copy(nic_virt, (const uint8_t *)src + tmp, len - tmp, simd);
+
+	return len - tmp;
+}
+
+/*
+ * xmit: NIC header, then the frame straight from txq
+ */
+static inline void xmit(uint32_t wr, struct ep_hw_hdr *hdr,
+		const uint8_t *body, int len, bool simd)
+{
+	wr = xmit_copy(wr, hdr, EP_HWHDR_SIZE, false);
+	xmit_copy(wr, body, len, simd);
+}
+
+/*
+ * ethpipe_xmit: copy the next txq record, of validated frame length len,
+ * into the reserved window range
+ * returns the TX window offset following the frame
+ */
+static inline uint32_t ethpipe_xmit(struct ep_ctx *ctx, uint32_t hw_write,
+		uint16_t len, bool simd)
+{
+	struct ep_ring *txq = &ctx->txq;
+	struct ep_hw_hdr hdr;
+
+	func_enter();
+
+	build_ep_pkt(txq, &hdr, len);
+	trace_ethpipe_xmit(ctx->q->idx, hw_write, len);
+	xmit(hw_write, &hdr, (uint8_t *)txq->read + EP_HDR_SIZE, len, simd);
+	ring_read_next_aligned(txq, EP_HDR_SIZE + len);
+
+	ctx->tx_avg_len += (len - (int)ctx->tx_avg_len) / 8;
+
+	return hwtx_xmit_next(hw_write, len);
+}
+
+/*
+ * tx_budget: number of frames to send in this round, sized from txq
+ * occupancy. The NIC TX window side is trimmed by the arbiter.
+ */
+static inline int tx_budget(const struct ep_ctx *ctx)
+{
+	int budget;
+
+	budget = ring_cons_count(&ctx->txq) / ALIGN(EP_HDR_SIZE + ctx->tx_avg_len, 4);
+	if (budget > tx_budget_max)
+		budget = tx_budget_max;
+	if (budget < tx_budget_min)
+		budget = tx_budget_min;
+	if (budget > EP_BATCH_MAX)
+		budget = EP_BATCH_MAX;
+
+	return budget;
+}
+
+/*
+ * tx_active_queues: TX queues with frames waiting for the NIC
+ */
+static inline int tx_active_queues(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < pdev->nr_txq; i++) {
+		if (ACCESS_ONCE(pdev->txqs[i].backlog))
+			++n;
+	}
+
+	return n ? n : 1;
+}
+
+/*
+ * ethpipe_doorbell: commit pending frames to NIC via pcie pio write.
+ * called with arb->lock held.
+ */
+static inline void ethpipe_doorbell(struct ep_txarb *arb)
+{
+	s64 now;
+
+	set_nic_txptr((uint32_t *)pdev->nic.tx.write, arb->hw_commit);
+	ep_stat_inc(EP_STAT_TX_DOORBELL);
+	trace_ethpipe_doorbell(arb->hw_commit, arb->db.pkts, arb->db.bytes);
+
+	if (lat_hist) {
+		now = ep_lat_now();
+		if (arb->db.deq)
+			ep_lat_add(EP_LAT_DOORBELL, now - arb->db.deq);
+		// time the NIC until it reads past this doorbell
+		if (arb->probe_ts == 0) {
+			arb->probe = arb->hw_commit;
+			arb->probe_ts = now;
+		}
+	}
+
+	arb->db.bytes = 0;
+	arb->db.pkts = 0;
+}
+
+/*
+ * doorbell_full: pending frames reached the byte or packet threshold
+ */
+static inline bool doorbell_full(const struct ep_doorbell *db)
+{
+	return !!((db->bytes >= tx_db_bytes) || (db->pkts >= tx_db_pkts));
+}
+
+/*
+ * doorbell_expired: the oldest pending frame waited tx_db_usecs
+ */
+static inline bool doorbell_expired(const struct ep_doorbell *db)
+{
+	return !!((local_clock() - db->since) >= (u64)tx_db_usecs * NSEC_PER_USEC);
+}
+
+/*
+ * hwtx_reserve: reserve room for up to npkts frames of q in the NIC TX
+ * window. While several queues are backlogged each one gets at most its
+ * fair share of the free space per round.
+ * returns the number of frames reserved, *start is the window offset.
+ */
+static inline int hwtx_reserve(struct ep_txq *q, const uint16_t *lens,
+		int npkts, uint32_t *start)
+{
+	struct ep_txarb *arb = &pdev->arb;
+	struct ep_hwresv *resv = &q->resv;
+	uint32_t free, share, bytes, size, hw_read;
+	int i;
+
+	spin_lock(&arb->lock);
+
+	// the NIC read pointer is an uncached pcie read. read it only when
+	// the space it freed last time does not fit the batch (or while a
+	// lat_hist probe waits for it). under the lock, so it never goes
+	// backwards against hw_write.
+	for (i = 0, bytes = 0; i < npkts; i++)
+		bytes += hwtx_frame_size(lens[i]);
+	free = hwtx_free_count(arb->hw_write, arb->hw_read);
+	if ((free < bytes) || arb->probe_ts) {
+		arb->hw_read = read_nic_txptr((uint32_t *)pdev->nic.tx.read);
+		free = hwtx_free_count(arb->hw_write, arb->hw_read);
+		ep_stat_inc(EP_STAT_TX_PTR_READ);
+	}
+	hw_read = arb->hw_read;
+	share = free / tx_active_queues();
+
+	// lat_hist: the NIC read past the probed doorbell
+	if (arb->probe_ts && (((arb->hw_commit - hw_read) & pdev->nic.tx.mask) <=
+			((arb->hw_commit - arb->probe) & pdev->nic.tx.mask))) {
+		ep_lat_add(EP_LAT_HW, ep_lat_now() - arb->probe_ts);
+		arb->probe_ts = 0;
+	}
+
+	for (i = 0, bytes = 0; i < npkts; i++) {
+		size = hwtx_frame_size(lens[i]);
+		if ((bytes + size > free) || (i && (bytes + size > share)))
+			break;
+		bytes += size;
+	}
+
+	if (i == 0) {
+		// NIC is busy. commit what is pending so it can drain.
+		if (arb->db.pkts)
+			ethpipe_doorbell(arb);
+		spin_unlock(&arb->lock);
+		return 0;
+	}
+
+	*start = arb->hw_write;
+	arb->hw_write = (arb->hw_write + bytes) & pdev->nic.tx.mask;
+	ep_hwm_update(&ep_hwm.nic_tx, pdev->nic.tx.mask - free + bytes);
+
+	resv->seq = arb->seq++;
+	resv->end = arb->hw_write;
+	resv->bytes = bytes;
+	resv->pkts = i;
+	resv->deq = lat_hist ? ep_lat_now() : 0;
+	resv->done = false;
+	resv->busy = true;
+
+	spin_unlock(&arb->lock);
+
+	return i;
+}
+
+/*
+ * hwtx_commit: mark the reservation of q as filled and move the NIC
+ * write pointer over every filled reservation in reservation order.
+ */
+static inline void hwtx_commit(struct ep_txq *q, bool idle)
+{
+	struct ep_txarb *arb = &pdev->arb;
+	struct ep_doorbell *db = &arb->db;
+	struct ep_hwresv *resv;
+	int i;
+
+	// frames must reach the NIC before any cpu rings the doorbell
+	wmb();
+
+	spin_lock(&arb->lock);
+
+	q->resv.done = true;
+
+	for (i = 0; i < pdev->nr_txq; i++) {
+		resv = &pdev->txqs[i].resv;
+		if (!resv->busy || (resv->seq != arb->commit_seq))
+			continue;
+		if (!resv->done)
+			break;
+
+		arb->hw_commit = resv->end;
+		if (db->pkts == 0) {
+			db->since = local_clock();
+			db->deq = resv->deq;
+		}
+		db->pkts += resv->pkts;
+		db->bytes += resv->bytes;
+
+		resv->busy = false;
+		++arb->commit_seq;
+		i = -1;    // rescan for the next reservation
+	}
+
+	// hold the doorbell back only while more frames are queued
+	if (db->pkts && (idle || doorbell_full(db) || doorbell_expired(db)))
+		ethpipe_doorbell(arb);
+
+	spin_unlock(&arb->lock);
+}
+
+/*
+ * lat_ingest_mark: lat_hist sample of a write() record about to be committed
+ */
+static inline void lat_ingest_mark(struct ep_ctx *ctx, uint8_t *rec)
+{
+	spin_lock(&ctx->lat_lock);
+	if (ctx->lat_rec == NULL) {
+		ctx->lat_rec = rec;
+		ctx->lat_ts = ep_lat_now();
+	}
+	spin_unlock(&ctx->lat_lock);
+}
+
+/*
+ * lat_ingest_check: the sampled record was dequeued from head up to
+ * txq->read, or dropped
+ */
+static inline void lat_ingest_check(struct ep_ctx *ctx, uint8_t *head,
+		bool drop)
+{
+	struct ep_ring *txq = &ctx->txq;
+
+	spin_lock(&ctx->lat_lock);
+	if (ctx->lat_rec && (drop ||
+	    (((uint32_t)(ctx->lat_rec - head) & txq->mask) <
+	     ((uint32_t)(txq->read - head) & txq->mask)))) {
+		if (!drop)
+			ep_lat_add(EP_LAT_INGEST, ep_lat_now() - ctx->lat_ts);
+		ctx->lat_rec = NULL;
+	}
+	spin_unlock(&ctx->lat_lock);
+}
+
+/*
+ * tx_deadline: ktime (ns) at which a frame with timestamp ts is due in
+ * tx_sched mode. A reset frame, or the first frame of a register,
+ * starts the register's time base at now.
+ */
+static inline s64 tx_deadline(struct ep_ctx *ctx, uint64_t ts, s64 now)
+{
+	uint8_t reg = ep_ts_reg(ts);
+	s64 val = (s64)ep_ts_val(ts) * EP_TS_TICK_NS;
+
+	if (ep_ts_reset(ts) || !ctx->ts_valid[reg]) {
+		ctx->ts_base[reg] = now - val;
+		ctx->ts_valid[reg] = true;
+	}
+
+	return ctx->ts_base[reg] + val;
+}
+
+/*
+ * ethpipe_send: send one batch of ctx, at most quota frame bytes.
+ * In tx_sched mode the batch stops at the first frame not yet due.
+ * returns the frame bytes sent.
+ */
+static inline int ethpipe_send(struct ep_txq *q, struct ep_ctx *ctx, int quota)
+{
+	int limit, npkts, i, len = 0, bytes = 0;
+	uint16_t lens[EP_BATCH_MAX];
+	uint32_t hw_write;
+	uint8_t *rec, *head;
+	struct ep_ring *txq = &ctx->txq;
+	bool sched = !!tx_sched, simd;
+	s64 now = 0, due;
+
+	func_enter();
+
+	ctx->ts_next = 0;
+
+	// skip records that a writer could not fill. their length comes
+	// from the ring, which a mmap()ed producer may have scribbled on
+	while (!ring_cons_empty(txq) && (ring_next_magic(txq) == EP_PAD_MAGIC)) {
+		len = ring_next_frame_len(txq);
+		if ((len > MAX_PKT_SIZE) ||
+				!ring_rec_fits(txq, txq->read, EP_HDR_SIZE + len)) {
+			pr_info("packet format error: pad frame_len=%X\n", len);
+			ep_stat_inc(EP_STAT_TX_FMT_ERR);
+			goto error;
+		}
+		ring_read_next_aligned(txq, EP_HDR_SIZE + len);
+	}
+	len = 0;
+	if (ring_cons_empty(txq)) {
+		ring_ctl_push_read(txq, ctx->txctl);
+		return 0;
+	}
+
+	if (sched)
+		now = ktime_to_ns(ktime_get());
+
+	// size xmit budget and collect a batch of well-formed records
+	limit = tx_budget(ctx);
+	ep_hwm_update(&ep_hwm.txq[q->idx], ring_cons_count(txq));
+	rec = txq->read;
+	for (npkts = 0; (npkts < limit) && (rec != txq->write_cache); npkts++) {
+		if (ep_rec_magic(rec) == EP_PAD_MAGIC)
+			break;
+		len = ep_rec_frame_len(rec);
+		if (len < 1)
+			break;
+		if (!ring_rec_fits(txq, rec, EP_HDR_SIZE + len)) {
+			pr_info("packet format error: frame_len=%X past write\n", len);
+			ep_stat_inc(EP_STAT_TX_FMT_ERR);
+			len = 0;
+			break;
+		}
+		// hold frames until their deadline
+		if (sched) {
+			due = tx_deadline(ctx, ep_rec_timestamp(rec), now);
+			if (due > now) {
+				ctx->ts_next = due;
+				break;
+			}
+		}
+		// the rest waits for the next round
+		if (bytes + len > quota)
+			break;
+		bytes += len;
+		lens[npkts] = len;
+		rec = ring_next_rec(txq, rec, EP_HDR_SIZE + len);
+	}
+	if (npkts == 0) {
+		if (len > 0)
+			return 0;    // out of credit, or not due yet
+		pr_info("err: ep_rec_frame_len() len=%d\n", len);
+		goto error;
+	}
+
+	i = hwtx_reserve(q, lens, npkts, &hw_write);
+	if (i == 0) {
+		ep_stat_inc(EP_STAT_TX_BUSY);
+		trace_ethpipe_tx_busy(q->idx, npkts, ACCESS_ONCE(pdev->arb.hw_read),
+				ACCESS_ONCE(pdev->arb.hw_write));
+		return 0;
+	}
+	npkts = i;
+
+	// sending
+	for (i = 0, bytes = 0; i < npkts; i++)
+		bytes += lens[i];
+	head = txq->read;
+	simd = wc_begin(bytes, npkts);
+	for (i = 0; i < npkts; i++)
+		hw_write = ethpipe_xmit(ctx, hw_write, lens[i], simd);
+	if (simd)
+		wc_end();
+	if (ACCESS_ONCE(ctx->lat_rec))
+		lat_ingest_check(ctx, head, false);
+	trace_ethpipe_send(q->idx, npkts, bytes, ACCESS_ONCE(pdev->arb.hw_read),
+			hw_write);
+	ctx->tx_counter += npkts;
+	q->tx_counter += npkts;    // incr tx_counter
+	ep_stat_add(EP_STAT_TX_PKTS, npkts);
+	ep_stat_add(EP_STAT_TX_BYTES, bytes);
+
+	ring_ctl_push_read(txq, ctx->txctl);
+
+	// commit to NIC. scheduled frames are not held for the doorbell
+	hwtx_commit(q, sched || ring_cons_empty(txq));
+
+	// debug
+	//dump_nic_info();
+
+	return bytes;
+
+error:
+	pr_info("kthread: tx_err\n");
+	// drop the queued records. only the consumer side is touched,
+	// so the producer (write() or a mmap()ed writer) keeps its index.
+	ring_cons_drop(txq);
+	ring_ctl_push_read(txq, ctx->txctl);
+	lat_ingest_check(ctx, NULL, true);
+	return 0;
+}
+
+/*
+ * ethpipe_txq_queued: bytes queued in the TX ring of ctx
+ */
+static inline uint32_t ethpipe_txq_queued(struct ep_ctx *ctx)
+{
+	struct ep_ring *txq = &ctx->txq;
+	uint32_t wr, rd;
+
+	if (!atomic_read(&ctx->txq_mapped))
+		return ring_count(txq);
+
+	// a mmap()ed producer keeps its index in the control page
+	wr = ACCESS_ONCE(ctx->txctl->write);
+	rd = (uint32_t)(ACCESS_ONCE(txq->read) - txq->start);
+
+	return ((wr - rd) & txq->mask);
+}
+
+/*
+ * ethpipe_txq_pending: a context of q has records queued
+ */
+static inline bool ethpipe_txq_pending(struct ep_txq *q)
+{
+	struct ep_ctx *ctx;
+	bool pending = false;
+
+	spin_lock(&q->ctx_lock);
+	list_for_each_entry(ctx, &q->ctx_list, list) {
+		if (ethpipe_txq_queued(ctx)) {
+			pending = true;
+			break;
+		}
+	}
+	spin_unlock(&q->ctx_lock);
+
+	return pending;
+}
+
+/*
+ * ethpipe_tx_kick: wake the TX kthread of q if it went to sleep
+ */
+static inline void ethpipe_tx_kick(struct ep_txq *q)
+{
+	struct task_struct *tsk;
+
+	// publish the records before looking at the kthread.
+	// pairs with the barrier in ethpipe_tx_idle().
+	smp_mb();
+	if (!ACCESS_ONCE(q->sleeping))
+		return;
+
+	tsk = ACCESS_ONCE(q->txth.tsk);
+	if (tsk)
+		wake_up_process(tsk);
+}
+
+/*
+ * ethpipe_txq_writable: txq has room for another record
+ */
+static inline bool ethpipe_txq_writable(struct ep_ctx *ctx)
+{
+	return !!((ctx->txq.mask - ethpipe_txq_queued(ctx)) >= RING_ALMOST_FULL);
+}
+
+/*
+ * ethpipe_sched: one deficit round robin round over the TX contexts of q.
+ * returns true if a context had frames waiting.
+ */
+static inline bool ethpipe_sched(struct ep_txq *q)
+{
+	struct ep_ctx *ctx;
+	int quantum = max(tx_quantum, MIN_PKT_SIZE);
+	int sent;
+	bool backlog = false;
+	s64 ts_next = 0;
+
+	spin_lock(&q->ctx_lock);
+
+	list_for_each_entry(ctx, &q->ctx_list, list) {
+		// pick up records published by a mmap()ed producer
+		if (atomic_read(&ctx->txq_mapped))
+			ring_ctl_pull_write(&ctx->txq, ctx->txctl);
+
+		if (ring_cons_sync(&ctx->txq) == 0) {
+			// an idle context does not save up credit
+			ctx->deficit = 0;
+			continue;
+		}
+
+		// credit is capped so a stalled NIC does not pile it up
+		ctx->deficit = min(ctx->deficit + quantum, quantum + MAX_PKT_SIZE);
+		sent = ethpipe_send(q, ctx, ctx->deficit);
+		ctx->deficit -= sent;
+
+		// a context that only holds frames for later is not backlogged
+		if ((sent == 0) && ctx->ts_next) {
+			if ((ts_next == 0) || (ctx->ts_next < ts_next))
+				ts_next = ctx->ts_next;
+		} else {
+			backlog = true;
+		}
+
+		// wake writers and pollers waiting for room. ethpipe_send()
+		// publishes the read pointer with a full barrier first.
+		if (waitqueue_active(&ctx->write_q) && ethpipe_txq_writable(ctx))
+			wake_up_interruptible(&ctx->write_q);
+	}
+
+	spin_unlock(&q->ctx_lock);
+
+	ACCESS_ONCE(q->backlog) = backlog;
+	q->ts_next = ts_next;
+	trace_ethpipe_tx_round(q->idx, backlog, ts_next);
+
+	return backlog;
+}
+
+#endif /* _ETHPIPE_TX_H_ */
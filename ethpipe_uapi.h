@@ -0,0 +1,114 @@
+#ifndef _ETHPIPE_UAPI_H_
+#define _ETHPIPE_UAPI_H_
+
+/*
+ * Definitions shared between the driver and userland tools.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * mmap() layout of /dev/ethpipe/N
+ *
+ *   +--------------------+ 0
+ *   | struct ep_ring_ctl |
+ *   +--------------------+ ctl->data_off (one page)
+ *   | TX ring            |
+ *   |   ctl->size bytes  |
+ *   +--------------------+
+ *   | slack              |  a record starting before ctl->size may run
+ *   |   ctl->slack bytes |  into here, so records never wrap
+ *   +--------------------+
+ *
+ * Producer protocol (userland):
+ *   - a record is pd_hdr (12 bytes) + frame, laid down at offset ctl->write
+ *   - only write when ((ctl->read - ctl->write - 1) & (ctl->size - 1))
+ *     is at least EP_RING_RESERVE bytes
+ *   - next = ALIGN(write + 12 + frame_len, EP_RING_ALIGN),
+ *     and next = 0 when next >= ctl->size
+ *   - publish the new offset to ctl->write after the record is written
+ *     (store-release)
+ *
+ * The TX kthread advances ctl->read as records are sent.
+ * While the ring is mapped, write(2) on the same device returns EBUSY;
+ * mmap(2) returns EBUSY while a write(2) is in progress.
+ */
+/*
+ * Record timestamp (pd_time, 8 bytes le, following magic and frame_len):
+ *   bits  0-47  value in 8 ns units
+ *   bits 48-59  reserved
+ *   bits 60-62  timestamp register (< 2)
+ *   bit     63  reset: the register's time base restarts at this frame
+ *
+ * With the tx_sched module parameter set, the driver holds each frame
+ * until base(reg) + value * 8 ns.
+ */
+
+#define EP_RING_ALIGN      4
+#define EP_RING_RESERVE    (9014*2)
+
+struct ep_ring_ctl {
+	__u32 size;         /* ring size (power of two) */
+	__u32 slack;        /* mapped bytes following the ring */
+	__u32 data_off;     /* mmap offset of the ring */
+	__u32 resv;
+	__u32 write;        /* producer offset, updated by userland */
+	__u32 read;         /* consumer offset, updated by the TX kthread */
+};
+
+/*
+ * ioctl control plane
+ *
+ * EP_IOC_GET_PARAMS/EP_IOC_SET_PARAMS read and write the datapath knobs
+ * that are otherwise module parameters.  txq_size applies to rings of
+ * later open()s.  SET needs CAP_NET_ADMIN, as does EP_IOC_SET_CPU.
+ *
+ * EP_IOC_DRAIN waits until the ring of this open() is sent, EP_IOC_FLUSH
+ * drops what is still queued in it.  Only opens for writing have a ring;
+ * on others both return at once and the ctx_ stats read 0.
+ */
+#define EP_NR_TXQ_MAX      8
+#define EP_IOC_RXQ         (~0U)    /* ep_ioc_cpu.queue of the RX kthread */
+
+struct ep_ioc_params {
+	__u32 txq_size;         /* TX ring bytes of a new open(), power of two */
+	__u32 rxq_size;         /* read only */
+	__u32 nr_txq;           /* read only */
+	__s32 tx_budget_min;    /* frames per kthread round */
+	__s32 tx_budget_max;
+	__s32 tx_db_bytes;      /* doorbell coalescing */
+	__s32 tx_db_pkts;
+	__s32 tx_db_usecs;
+	__s32 tx_quantum;       /* DRR bytes per context and round */
+	__s32 tx_sched;         /* hold frames until their timestamp */
+	__s32 tx_sched_spin_ns;
+	__s32 busy_poll;        /* idle kthreads spin instead of sleeping */
+	__s32 tx_spin_us;       /* idle TX kthread spins this long first */
+	__s32 rx_spin_us;       /* idle RX kthread spins this long first */
+	__s32 rx_poll_us;       /* then polls the NIC this often */
+};
+
+struct ep_ioc_cpu {
+	__u32 queue;            /* TX queue index, or EP_IOC_RXQ */
+	__s32 cpu;              /* -1: any cpu */
+};
+
+struct ep_ioc_stats {
+	__u64 tx_pkts[EP_NR_TXQ_MAX];   /* per TX queue */
+	__u64 rx_pkts;
+	__u64 ctx_tx_pkts;      /* sent from this open() */
+	__u32 ctx_queued;       /* bytes queued in this open() */
+	__u32 nr_txq;
+};
+
+#define EP_IOC_MAGIC       'E'
+#define EP_IOC_GET_PARAMS  _IOR(EP_IOC_MAGIC, 0x01, struct ep_ioc_params)
+#define EP_IOC_SET_PARAMS  _IOW(EP_IOC_MAGIC, 0x02, struct ep_ioc_params)
+#define EP_IOC_GET_CPU     _IOWR(EP_IOC_MAGIC, 0x03, struct ep_ioc_cpu)
+#define EP_IOC_SET_CPU     _IOW(EP_IOC_MAGIC, 0x04, struct ep_ioc_cpu)
+#define EP_IOC_DRAIN       _IO(EP_IOC_MAGIC, 0x05)
+#define EP_IOC_FLUSH       _IO(EP_IOC_MAGIC, 0x06)
+#define EP_IOC_GET_STATS   _IOR(EP_IOC_MAGIC, 0x07, struct ep_ioc_stats)
+
+#endif /* _ETHPIPE_UAPI_H_ */